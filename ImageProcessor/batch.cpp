@@ -0,0 +1,162 @@
+#include "batch.h"
+#include "bounded_queue.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <glob.h>
+
+std::vector<TBatchJob> ReadManifest(const std::string& manifest_path) {
+    std::ifstream manifest(manifest_path);
+    if (!manifest) {
+        throw(std::runtime_error("Failed to open " + manifest_path + "\n"));
+    }
+    std::vector<TBatchJob> jobs;
+    std::string line;
+    for (int32_t line_number = 1; std::getline(manifest, line); ++line_number) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        const size_t begin = line.find_first_not_of(" \t");
+        if (begin == std::string::npos || line[begin] == '#') {
+            continue;
+        }
+        const size_t tab = line.find('\t', begin);
+        const size_t separator = tab != std::string::npos ? tab : line.find(' ', begin);
+        const size_t output = separator == std::string::npos ? separator : line.find_first_not_of(" \t", separator);
+        if (output == std::string::npos) {
+            throw(std::runtime_error(manifest_path + ":" + std::to_string(line_number) + ": expected input and output paths\n"));
+        }
+        const size_t end = line.find_last_not_of(" \t");
+        jobs.emplace_back(TBatchJob{line.substr(begin, separator - begin), line.substr(output, end + 1 - output)});
+    }
+    return jobs;
+}
+
+std::vector<TBatchJob> GlobJobs(const std::string& pattern, const std::string& output_directory) {
+    glob_t matches;
+    const int status = glob(pattern.c_str(), 0, nullptr, &matches);
+    if (status == GLOB_NOMATCH) {
+        globfree(&matches);
+        return {};
+    }
+    if (status != 0) {
+        globfree(&matches);
+        throw(std::runtime_error("Failed to expand " + pattern + "\n"));
+    }
+    std::vector<TBatchJob> jobs;
+    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+        const std::filesystem::path input = matches.gl_pathv[i];
+        jobs.emplace_back(TBatchJob{input.string(), (output_directory / input.filename()).string()});
+    }
+    globfree(&matches);
+    return jobs;
+}
+
+std::unique_ptr<Image> ImagePool::Acquire() {
+    std::lock_guard lock(mutex_);
+    if (free_.empty()) {
+        return std::make_unique<Image>();
+    }
+    std::unique_ptr<Image> image = std::move(free_.back());
+    free_.pop_back();
+    return image;
+}
+
+void ImagePool::Release(std::unique_ptr<Image> image) {
+    std::lock_guard lock(mutex_);
+    free_.emplace_back(std::move(image));
+}
+
+namespace {
+/* A file on its way through the stages of ProcessBatch */
+struct TBatchItem {
+    const TBatchJob* Job = nullptr;
+    std::unique_ptr<Image> Decoded;
+    FilterChain Chain;
+};
+}  // namespace
+
+bool ProcessBatch(const std::vector<TBatchJob>& jobs, const std::vector<TParams>& arguments, size_t depth) {
+    ImagePool images;
+    std::mutex error_mutex;
+    std::atomic<bool> succeeded = true;
+    /* Any failure, an allocation included, costs only its own file */
+    auto report = [&](TBatchItem& item, const std::exception& e) {
+        succeeded = false;
+        {
+            std::lock_guard lock(error_mutex);
+            const std::string message = e.what();
+            std::cerr << item.Job->Input << ": " << message << (message.ends_with('\n') ? "" : "\n");
+        }
+        if (item.Decoded) {
+            images.Release(std::move(item.Decoded));
+        }
+    };
+
+    BoundedQueue<TBatchItem> decoded(depth);
+    BoundedQueue<TBatchItem> processed(depth);
+    /* Point filter chains already interleave reading and writing in bands of rows, which needs far less memory
+       than whole decoded images, so the workers run those files from start to end */
+    const bool streaming = CanStream(arguments);
+
+    /* Reading runs ahead of the workers until the queue is full, writing trails them */
+    std::thread reader([&] {
+        for (const TBatchJob& job : jobs) {
+            TBatchItem item{&job, nullptr, {}};
+            try {
+                item.Decoded = images.Acquire();
+                if (!streaming) {
+                    item.Chain = DecodeForChain(job.Input, arguments, *item.Decoded);
+                }
+            } catch (std::exception& e) {
+                report(item, e);
+                continue;
+            }
+            decoded.Push(std::move(item));
+        }
+        decoded.Close();
+    });
+    /* Workers take whole files, the filters inside a file still split their rows over whichever pool threads are
+       idle */
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < GetThreadPool().GetConcurrency(); ++i) {
+        workers.emplace_back([&] {
+            TBatchItem item;
+            while (decoded.Pop(item)) {
+                try {
+                    if (streaming) {
+                        ProcessFile(item.Job->Input, item.Job->Output, arguments, *item.Decoded);
+                        images.Release(std::move(item.Decoded));
+                        continue;
+                    }
+                    RunChain(item.Chain, *item.Decoded);
+                } catch (std::exception& e) {
+                    report(item, e);
+                    continue;
+                }
+                processed.Push(std::move(item));
+            }
+        });
+    }
+    std::thread writer([&] {
+        TBatchItem item;
+        while (processed.Pop(item)) {
+            try {
+                WriteImage(*item.Decoded, item.Job->Output);
+            } catch (std::exception& e) {
+                report(item, e);
+                continue;
+            }
+            images.Release(std::move(item.Decoded));
+        }
+    });
+
+    reader.join();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    processed.Close();
+    writer.join();
+    return succeeded;
+}
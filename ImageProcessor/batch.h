@@ -0,0 +1,34 @@
+#pragma once
+#include "pipeline.h"
+#include <mutex>
+
+const size_t BATCH_QUEUE_DEPTH = 2;
+
+struct TBatchJob {
+    std::string Input;
+    std::string Output;
+};
+
+/* One "input output" pair per line, separated by a tab or spaces. Empty lines and lines starting with '#' are
+   skipped. A tab separator allows spaces inside both paths. */
+std::vector<TBatchJob> ReadManifest(const std::string& manifest_path);
+/* Every file matching the glob(3) `pattern`, written under the same name into `output_directory` */
+std::vector<TBatchJob> GlobJobs(const std::string& pattern, const std::string& output_directory);
+
+/* Free list of images, so pixel buffers sized by earlier files are reused instead of reallocated */
+class ImagePool {
+public:
+    std::unique_ptr<Image> Acquire();
+    void Release(std::unique_ptr<Image> image);
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Image>> free_;
+};
+
+/* Runs the same filter chain over every job as a three-stage pipeline: a reader thread decodes the next files
+   while workers (as many as the thread pool runs at once) filter, and a writer thread encodes the finished ones.
+   The stages are connected by queues of `depth` images, so at most 2 * depth + workers + 2 images are alive.
+   A failed job is reported to stderr and does not stop the others; returns false if any job failed. */
+bool ProcessBatch(const std::vector<TBatchJob>& jobs, const std::vector<TParams>& arguments,
+                  size_t depth = BATCH_QUEUE_DEPTH);
@@ -0,0 +1,357 @@
+#include "bmp_io.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+const uint16_t BMP_SIGNATURE = 0x4D42; /* "BM" read as little-endian */
+const uint16_t BMP_BITS = 24;
+const uint32_t BMP_NO_COMPRESSION = 0;
+
+void ConvertBgrRow(const uint8_t* source, Pixel* destination, int32_t width) {
+    for (int32_t pixel = 0; pixel < width; ++pixel) {
+        destination[pixel].R = source[2];
+        destination[pixel].G = source[1];
+        destination[pixel].B = source[0];
+        source += PIXEL_SIZE;
+    }
+}
+
+void ConvertToBgrRow(const Pixel* source, uint8_t* destination, int32_t width) {
+    for (int32_t pixel = 0; pixel < width; ++pixel) {
+        destination[0] = source[pixel].B;
+        destination[1] = source[pixel].G;
+        destination[2] = source[pixel].R;
+        destination += PIXEL_SIZE;
+    }
+}
+
+void ConvertLumaToBgrRow(const uint8_t* source, uint8_t* destination, int32_t width) {
+    for (int32_t pixel = 0; pixel < width; ++pixel) {
+        destination[0] = source[pixel];
+        destination[1] = source[pixel];
+        destination[2] = source[pixel];
+        destination += PIXEL_SIZE;
+    }
+}
+
+BmpReader::BmpReader(const std::string& input_path) : path_(input_path) {
+    fd_ = open(input_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        throw(std::runtime_error("Failed to open " + input_path + "\n"));
+    }
+
+    struct stat file_stat;
+    if (fstat(fd_, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+        void* map = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (map != MAP_FAILED) {
+            map_ = static_cast<const uint8_t*>(map);
+            map_size_ = static_cast<size_t>(file_stat.st_size);
+            madvise(map, map_size_, MADV_SEQUENTIAL);
+        }
+    }
+
+    try {
+        ReadHeaders();
+        ValidateHeaders();
+    } catch (...) {
+        Close();
+        throw;
+    }
+}
+
+BmpReader::BmpReader(const uint8_t* data, size_t size) : path_("<memory>"), map_(data), map_size_(size) {
+    if (data == nullptr) {
+        throw(std::runtime_error("The specified path is not a bitmap image.\n"));
+    }
+    ReadHeaders();
+    ValidateHeaders();
+}
+
+BmpReader::~BmpReader() {
+    Close();
+}
+
+void BmpReader::Close() {
+    /* Memory of the caller is not ours to unmap */
+    if (map_ != nullptr && fd_ >= 0) {
+        munmap(const_cast<uint8_t*>(map_), map_size_);
+        map_ = nullptr;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+const TFileHeader& BmpReader::GetFileHeader() const {
+    return file_header_;
+}
+const TInfoHeader& BmpReader::GetInfoHeader() const {
+    return info_header_;
+}
+int32_t BmpReader::GetWidth() const {
+    return info_header_.width;
+}
+int32_t BmpReader::GetHeight() const {
+    return info_header_.height;
+}
+size_t BmpReader::GetRowBytes() const {
+    return row_bytes_;
+}
+bool BmpReader::IsMapped() const {
+    return map_ != nullptr;
+}
+
+void BmpReader::ReadHeaders() {
+    uint8_t headers[sizeof(TFileHeader) + sizeof(TInfoHeader)];
+    if (map_ != nullptr) {
+        if (map_size_ < sizeof(headers)) {
+            throw(std::runtime_error("The specified path is not a bitmap image.\n"));
+        }
+        std::memcpy(headers, map_, sizeof(headers));
+    } else {
+        ReadExactly(headers, sizeof(headers));
+    }
+    std::memcpy(&file_header_, headers, sizeof(TFileHeader));
+    std::memcpy(&info_header_, headers + sizeof(TFileHeader), sizeof(TInfoHeader));
+}
+
+void BmpReader::ValidateHeaders() {
+    if (file_header_.HeaderField != BMP_SIGNATURE) {
+        throw(std::runtime_error("The specified path is not a bitmap image.\n"));
+    }
+    if (info_header_.Size < sizeof(TInfoHeader) || info_header_.bits != BMP_BITS ||
+        info_header_.compression != BMP_NO_COMPRESSION) {
+        throw(std::runtime_error("Only uncompressed 24-bit bitmaps are supported.\n"));
+    }
+    if (info_header_.width <= 0 || info_header_.height <= 0) {
+        throw(std::runtime_error("Unsupported bitmap dimensions in " + path_ + "\n"));
+    }
+    if (file_header_.Offset < sizeof(TFileHeader) + info_header_.Size) {
+        throw(std::runtime_error("Pixel data overlaps the bitmap header in " + path_ + "\n"));
+    }
+
+    row_bytes_ = (static_cast<size_t>(info_header_.width) * PIXEL_SIZE + PIXELS_ALIGNMENT - 1) / PIXELS_ALIGNMENT *
+                 PIXELS_ALIGNMENT;
+    if (map_ != nullptr && map_size_ < file_header_.Offset + row_bytes_ * static_cast<size_t>(info_header_.height)) {
+        throw(std::runtime_error("Bitmap " + path_ + " is truncated\n"));
+    }
+}
+
+void BmpReader::ReadExactly(uint8_t* destination, size_t size) {
+    while (size > 0) {
+        ssize_t done = read(fd_, destination, size);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            throw(std::runtime_error("Bitmap " + path_ + " is truncated\n"));
+        }
+        destination += done;
+        size -= static_cast<size_t>(done);
+        position_ += static_cast<size_t>(done);
+    }
+}
+
+void BmpReader::SkipTo(size_t position) {
+    if (position < position_) {
+        throw(std::runtime_error("Cannot seek backwards in " + path_ + "\n"));
+    }
+    if (position > position_ && lseek(fd_, static_cast<off_t>(position), SEEK_SET) >= 0) {
+        position_ = position;
+        return;
+    }
+    buffer_.resize(READ_BUFFER_SIZE);
+    while (position_ < position) {
+        ReadExactly(buffer_.data(), std::min(buffer_.size(), position - position_));
+    }
+}
+
+void BmpReader::ReadRows(int32_t first_row, int32_t count, Pixel* destination, size_t stride) {
+    ReadRows(first_row, count, 0, info_header_.width, destination, stride);
+}
+
+void BmpReader::ReadRows(int32_t first_row, int32_t count, int32_t first_column, int32_t columns, Pixel* destination,
+                         size_t stride) {
+    if (first_row < 0 || count < 0 || first_row + count > info_header_.height) {
+        throw(std::runtime_error("Row range is out of the bitmap bounds\n"));
+    }
+    if (first_column < 0 || columns < 0 || first_column + columns > info_header_.width) {
+        throw(std::runtime_error("Column range is out of the bitmap bounds\n"));
+    }
+    const size_t data_begin = file_header_.Offset + row_bytes_ * static_cast<size_t>(first_row);
+    const size_t column_offset = static_cast<size_t>(first_column) * PIXEL_SIZE;
+
+    if (map_ != nullptr) {
+        /* Sequential readahead would fault in the skipped columns too when only a narrow span is needed */
+        if (fd_ >= 0 && static_cast<size_t>(columns) * PIXEL_SIZE * 2 < row_bytes_) {
+            madvise(const_cast<uint8_t*>(map_), map_size_, MADV_RANDOM);
+        }
+        const uint8_t* source = map_ + data_begin + column_offset;
+        for (int32_t row = 0; row < count; ++row) {
+            ConvertBgrRow(source, destination, columns);
+            source += row_bytes_;
+            destination += stride;
+        }
+        return;
+    }
+
+    SkipTo(data_begin);
+    const size_t rows_per_read = std::max<size_t>(1, READ_BUFFER_SIZE / row_bytes_);
+    buffer_.resize(rows_per_read * row_bytes_);
+    for (int32_t row = 0; row < count;) {
+        const size_t rows = std::min(rows_per_read, static_cast<size_t>(count - row));
+        ReadExactly(buffer_.data(), rows * row_bytes_);
+        for (size_t i = 0; i < rows; ++i) {
+            ConvertBgrRow(buffer_.data() + i * row_bytes_ + column_offset, destination, columns);
+            destination += stride;
+        }
+        row += static_cast<int32_t>(rows);
+    }
+}
+
+BmpWriter::BmpWriter(const std::string& output_path, int32_t width, int32_t height, const TInfoHeader& info_template)
+    : path_(output_path), width_(width), height_(height), info_header_(info_template) {
+    InitHeaders();
+    fd_ = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd_ < 0) {
+        throw(std::runtime_error("Failed to create " + output_path + "\n"));
+    }
+    buffer_.resize(std::max(row_bytes_, WRITE_BUFFER_SIZE / row_bytes_ * row_bytes_));
+}
+
+BmpWriter::BmpWriter(std::vector<uint8_t>& output, int32_t width, int32_t height, const TInfoHeader& info_template)
+    : path_("<memory>"), output_(&output), width_(width), height_(height), info_header_(info_template) {
+    InitHeaders();
+    output.clear();
+    output.reserve(file_header_.Size);
+    buffer_.resize(std::max(row_bytes_, WRITE_BUFFER_SIZE / row_bytes_ * row_bytes_));
+}
+
+void BmpWriter::InitHeaders() {
+    row_bytes_ =
+        (static_cast<size_t>(width_) * PIXEL_SIZE + PIXELS_ALIGNMENT - 1) / PIXELS_ALIGNMENT * PIXELS_ALIGNMENT;
+
+    info_header_.Size = sizeof(TInfoHeader);
+    info_header_.width = width_;
+    info_header_.height = height_;
+    info_header_.planes = 1;
+    info_header_.bits = BMP_BITS;
+    info_header_.compression = BMP_NO_COMPRESSION;
+    info_header_.imagesize = static_cast<uint32_t>(row_bytes_ * static_cast<size_t>(height_));
+    file_header_.HeaderField = BMP_SIGNATURE;
+    file_header_.Reserved = 0;
+    file_header_.Offset = sizeof(TFileHeader) + sizeof(TInfoHeader);
+    file_header_.Size = file_header_.Offset + info_header_.imagesize;
+}
+
+BmpWriter::~BmpWriter() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+/* convert(destination) fills the next row of the band buffer, the padding is zeroed here */
+template <typename Convert>
+void BmpWriter::WriteConverted(int32_t count, Convert convert) {
+    if (rows_written_ + count > height_) {
+        throw(std::runtime_error("Too many rows written to " + path_ + "\n"));
+    }
+    for (int32_t row = 0; row < count; ++row) {
+        if (buffered_ + row_bytes_ > buffer_.size()) {
+            Flush();
+        }
+        uint8_t* destination = buffer_.data() + buffered_;
+        convert(destination);
+        std::fill(destination + static_cast<size_t>(width_) * PIXEL_SIZE, destination + row_bytes_, 0);
+        buffered_ += row_bytes_;
+    }
+    rows_written_ += count;
+}
+
+void BmpWriter::WriteRows(const Pixel* source, int32_t count, size_t stride) {
+    WriteConverted(count, [&](uint8_t* destination) {
+        ConvertToBgrRow(source, destination, width_);
+        source += stride;
+    });
+}
+
+void BmpWriter::WriteLumaRows(const uint8_t* source, int32_t count, size_t stride) {
+    WriteConverted(count, [&](uint8_t* destination) {
+        ConvertLumaToBgrRow(source, destination, width_);
+        source += stride;
+    });
+}
+
+void BmpWriter::Finish() {
+    if (rows_written_ != height_) {
+        throw(std::runtime_error("Not all rows were written to " + path_ + "\n"));
+    }
+    Flush();
+    if (output_ != nullptr) {
+        return;
+    }
+    int fd = fd_;
+    fd_ = -1;
+    if (close(fd) != 0) {
+        throw(std::runtime_error("Failed to write " + path_ + "\n"));
+    }
+}
+
+void BmpWriter::Flush() {
+    if (!header_written_ && output_ != nullptr) {
+        WriteAll(reinterpret_cast<const uint8_t*>(&file_header_), sizeof(TFileHeader));
+        WriteAll(reinterpret_cast<const uint8_t*>(&info_header_), sizeof(TInfoHeader));
+        header_written_ = true;
+    }
+    if (!header_written_) {
+        iovec parts[3] = {
+            {&file_header_, sizeof(TFileHeader)},
+            {&info_header_, sizeof(TInfoHeader)},
+            {buffer_.data(), buffered_},
+        };
+        const size_t total = sizeof(TFileHeader) + sizeof(TInfoHeader) + buffered_;
+        ssize_t done = writev(fd_, parts, 3);
+        if (done < 0 && errno != EINTR) {
+            throw(std::runtime_error("Failed to write " + path_ + "\n"));
+        }
+        header_written_ = true;
+        if (static_cast<size_t>(std::max<ssize_t>(done, 0)) < total) {
+            /* Short writev, finish the rest piece by piece */
+            size_t skip = static_cast<size_t>(std::max<ssize_t>(done, 0));
+            for (const iovec& part : parts) {
+                if (skip >= part.iov_len) {
+                    skip -= part.iov_len;
+                    continue;
+                }
+                WriteAll(static_cast<const uint8_t*>(part.iov_base) + skip, part.iov_len - skip);
+                skip = 0;
+            }
+        }
+    } else {
+        WriteAll(buffer_.data(), buffered_);
+    }
+    buffered_ = 0;
+}
+
+void BmpWriter::WriteAll(const uint8_t* data, size_t size) {
+    if (output_ != nullptr) {
+        output_->insert(output_->end(), data, data + size);
+        return;
+    }
+    while (size > 0) {
+        ssize_t done = write(fd_, data, size);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            throw(std::runtime_error("Failed to write " + path_ + "\n"));
+        }
+        data += done;
+        size -= static_cast<size_t>(done);
+    }
+}
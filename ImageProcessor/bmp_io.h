@@ -0,0 +1,91 @@
+#pragma once
+#include "image_processor.h"
+
+const size_t READ_BUFFER_SIZE = 1 << 20;
+const size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+/* Decoder for 24-bit uncompressed BMP files. Regular files are mapped into memory and decoded in place,
+   anything that cannot be mapped (pipes, character devices) is consumed sequentially with large read(2) calls. */
+class BmpReader {
+public:
+    explicit BmpReader(const std::string& input_path);
+    /* Decodes a whole file held by the caller, which must keep `data` alive for the lifetime of the reader */
+    BmpReader(const uint8_t* data, size_t size);
+    BmpReader(const BmpReader&) = delete;
+    BmpReader& operator=(const BmpReader&) = delete;
+    ~BmpReader();
+
+    const TFileHeader& GetFileHeader() const;
+    const TInfoHeader& GetInfoHeader() const;
+    int32_t GetWidth() const;
+    int32_t GetHeight() const;
+    size_t GetRowBytes() const;
+    bool IsMapped() const;
+
+    /* Decodes `count` rows starting at file row `first_row` (rows are counted bottom-up, as stored) into
+       consecutive destination rows `stride` pixels apart. Unmapped sources only allow non-decreasing rows. */
+    void ReadRows(int32_t first_row, int32_t count, Pixel* destination, size_t stride);
+    /* Same, decoding only `columns` pixels of each row starting at `first_column` */
+    void ReadRows(int32_t first_row, int32_t count, int32_t first_column, int32_t columns, Pixel* destination,
+                  size_t stride);
+
+private:
+    void Close();
+    void ReadHeaders();
+    void ValidateHeaders();
+    void ReadExactly(uint8_t* destination, size_t size);
+    void SkipTo(size_t position);
+
+    std::string path_;
+    int fd_ = -1;
+    const uint8_t* map_ = nullptr;
+    size_t map_size_ = 0;
+    size_t position_ = 0; /* Bytes consumed so far from an unmapped source */
+    size_t row_bytes_ = 0;
+    TFileHeader file_header_;
+    TInfoHeader info_header_;
+    std::vector<uint8_t> buffer_;
+};
+
+/* Encoder for 24-bit uncompressed BMP files. Rows are converted into padded BGR rows in a reusable band buffer
+   which is emitted with a few large writes, the headers go out together with the first band through writev. */
+class BmpWriter {
+public:
+    /* `info_template` supplies the resolution fields, everything describing the layout is recomputed */
+    BmpWriter(const std::string& output_path, int32_t width, int32_t height, const TInfoHeader& info_template);
+    /* Encodes into `output` instead of a file, replacing its contents */
+    BmpWriter(std::vector<uint8_t>& output, int32_t width, int32_t height, const TInfoHeader& info_template);
+    BmpWriter(const BmpWriter&) = delete;
+    BmpWriter& operator=(const BmpWriter&) = delete;
+    ~BmpWriter();
+
+    /* Appends `count` rows in file (bottom-up) order, consecutive source rows are `stride` pixels apart */
+    void WriteRows(const Pixel* source, int32_t count, size_t stride);
+    /* Same for single-channel rows, every byte becomes a gray pixel */
+    void WriteLumaRows(const uint8_t* source, int32_t count, size_t stride);
+    void Finish();
+
+private:
+    void InitHeaders();
+    template <typename Convert>
+    void WriteConverted(int32_t count, Convert convert);
+    void Flush();
+    void WriteAll(const uint8_t* data, size_t size);
+
+    std::string path_;
+    int fd_ = -1;
+    std::vector<uint8_t>* output_ = nullptr; /* Set when encoding into memory */
+    int32_t width_;
+    int32_t height_;
+    int32_t rows_written_ = 0;
+    size_t row_bytes_;
+    bool header_written_ = false;
+    TFileHeader file_header_;
+    TInfoHeader info_header_;
+    std::vector<uint8_t> buffer_;
+    size_t buffered_ = 0;
+};
+
+void ConvertBgrRow(const uint8_t* source, Pixel* destination, int32_t width);
+void ConvertToBgrRow(const Pixel* source, uint8_t* destination, int32_t width);
+void ConvertLumaToBgrRow(const uint8_t* source, uint8_t* destination, int32_t width);
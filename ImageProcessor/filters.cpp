@@ -1,56 +1,331 @@
 #include "filters.h"
 
-void GrayscaleFilter::Process(Image& image) {
-    for (size_t row = 0; row < image.GetHeight(); ++row) {
-        for (size_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            const Pixel& temp_p = image.GetPixel(row, pixel);
-            float gray = REDTOGRAYCOEF * static_cast<float>(temp_p.R) + GREENTOGRAYCOEF * static_cast<float>(temp_p.G) +
-                         BLUETOGRAYCOEF * static_cast<float>(temp_p.B);
-            image.SetPixelFl(row, pixel, gray, gray, gray);
-        }
-    }
+void CropFilter::Process(Image& image) {
+    image.Crop(x_, y_, width_, height_);
+}
+
+const char* CropFilter::GetName() const {
+    return "crop";
+}
+
+bool CropFilter::WritesInPlace() const {
+    return false;
+}
+
+void CropFilter::SetSize(int32_t& width, int32_t& height) {
+    width_ = width;
+    height_ = height;
+}
+
+void CropFilter::SetOrigin(int32_t& x, int32_t& y) {
+    x_ = x;
+    y_ = y;
 }
 
 void SepiaFilter::Process(Image& image) {
-    for (size_t row = 0; row < image.GetHeight(); ++row) {
-        for (size_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            const Pixel& temp_p = image.GetPixel(row, pixel);
+    image.ToRgb();
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        for (Pixel& temp_p : image.GetRowSpan(row)) {
             int32_t sepia_r = static_cast<int32_t>(temp_p.R) + (DEPTH * 2);
             int32_t sepia_g = static_cast<int32_t>(temp_p.G) - DEPTH;
             int32_t sepia_b = static_cast<int32_t>(temp_p.B) - INTENSITY * 2;
-            image.SetPixel32(row, pixel, sepia_r, sepia_g, sepia_b);
+            temp_p.SetColor32(sepia_r, sepia_g, sepia_b);
         }
     }
 }
 
+const char* SepiaFilter::GetName() const {
+    return "sepia";
+}
+
+uint8_t SepiaFilter::MapChannel(size_t channel, uint8_t value) const {
+    const int32_t offsets[CHANNELS] = {DEPTH * 2, -DEPTH, -INTENSITY * 2};
+    return static_cast<uint8_t>(
+        std::clamp(static_cast<int32_t>(value) + offsets[channel], 0, static_cast<int32_t>(BYTEMAXIMUMVALUE)));
+}
+
 void ContrastFilter::Process(Image& image) {
-    for (size_t row = 0; row < image.GetHeight(); ++row) {
-        for (size_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            const Pixel& temp_p = image.GetPixel(row, pixel);
+    image.ToRgb();
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        for (Pixel& temp_p : image.GetRowSpan(row)) {
             int32_t contrasted_r = static_cast<int32_t>(static_cast<float>(temp_p.R) * coef_);
             int32_t contrasted_g = static_cast<int32_t>(static_cast<float>(temp_p.G) * coef_);
             int32_t contrasted_b = static_cast<int32_t>(static_cast<float>(temp_p.B) * coef_);
-            image.SetPixel32(row, pixel, contrasted_r, contrasted_g, contrasted_b);
+            temp_p.SetColor32(contrasted_r, contrasted_g, contrasted_b);
         }
     }
 }
 
+const char* ContrastFilter::GetName() const {
+    return "contrast";
+}
+
+uint8_t ContrastFilter::MapChannel(size_t, uint8_t value) const {
+    return static_cast<uint8_t>(std::clamp(static_cast<int32_t>(static_cast<float>(value) * coef_), 0,
+                                           static_cast<int32_t>(BYTEMAXIMUMVALUE)));
+}
+
 void ContrastFilter::SetCoef(float& coef) {
     coef_ = coef;
 }
 
 void NegativeFilter::Process(Image& image) {
-    for (size_t row = 0; row < image.GetHeight(); ++row) {
-        for (size_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            Pixel temp_p = image.GetPixel(row, pixel);
+    image.ToRgb();
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        for (Pixel& temp_p : image.GetRowSpan(row)) {
             temp_p.R = BYTEMAXIMUMVALUE - temp_p.R;
             temp_p.G = BYTEMAXIMUMVALUE - temp_p.G;
             temp_p.B = BYTEMAXIMUMVALUE - temp_p.B;
-            image.SetPixel(row, pixel, temp_p.R, temp_p.G, temp_p.B);
         }
     }
 }
 
+const char* NegativeFilter::GetName() const {
+    return "negative";
+}
+
+uint8_t NegativeFilter::MapChannel(size_t, uint8_t value) const {
+    return BYTEMAXIMUMVALUE - value;
+}
+
+LookupTableFilter::LookupTableFilter() {
+    for (auto& channel_table : table_) {
+        for (size_t value = 0; value < LOOKUP_TABLE_SIZE; ++value) {
+            channel_table[value] = static_cast<uint8_t>(value);
+        }
+    }
+}
+
+void LookupTableFilter::Process(Image& image) {
+    if (is_identity_) {
+        return;
+    }
+    image.ToRgb();
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        ProcessRow(image.GetRow(row), image.GetWidth());
+    }
+}
+
+const char* LookupTableFilter::GetName() const {
+    return "lookup table";
+}
+
+void LookupTableFilter::ProcessRow(Pixel* row, size_t width) const {
+    const auto& red = table_[RED_CHANNEL];
+    const auto& green = table_[GREEN_CHANNEL];
+    const auto& blue = table_[BLUE_CHANNEL];
+    for (size_t pixel = 0; pixel < width; ++pixel) {
+        row[pixel] = Pixel{red[row[pixel].R], green[row[pixel].G], blue[row[pixel].B]};
+    }
+}
+
+bool LookupTableFilter::IsIdentity() const {
+    return is_identity_;
+}
+
+bool LookupTableFilter::IsUniform() const {
+    return is_identity_ || (table_[RED_CHANNEL] == table_[GREEN_CHANNEL] && table_[RED_CHANNEL] == table_[BLUE_CHANNEL]);
+}
+
+void LookupTableFilter::SetTable(const LookupTable& table) {
+    table_ = table;
+    is_identity_ = false;
+}
+
+uint8_t LookupTableFilter::MapChannel(size_t channel, uint8_t value) const {
+    return table_[channel][value];
+}
+
+void LookupTableFilter::Append(const ChannelFilter& filter) {
+    for (size_t channel = 0; channel < CHANNELS; ++channel) {
+        for (auto& entry : table_[channel]) {
+            entry = filter.MapChannel(channel, entry);
+        }
+    }
+    is_identity_ = false;
+}
+
+void ColorMatrixFilter::SetMatrix(const ColorMatrix& matrix, const ColorOffset& offset) {
+    matrix_ = matrix;
+    offset_ = offset;
+    has_matrix_ = true;
+    is_gray_ = std::all_of(matrix.begin(), matrix.end(), [&](const auto& row) { return row == matrix[0]; }) &&
+               std::all_of(offset.begin(), offset.end(), [&](float value) { return value == offset[0]; });
+}
+
+bool ColorMatrixFilter::HasMatrix() const {
+    return has_matrix_;
+}
+
+bool ColorMatrixFilter::IsGray() const {
+    return has_matrix_ && is_gray_;
+}
+
+uint8_t ColorMatrixFilter::ApplyMatrix(size_t channel, uint8_t r, uint8_t g, uint8_t b) const {
+    const auto& row = matrix_[channel];
+    float value = row[RED_CHANNEL] * static_cast<float>(r) + row[GREEN_CHANNEL] * static_cast<float>(g) +
+                  row[BLUE_CHANNEL] * static_cast<float>(b) + offset_[channel];
+    value = std::max(static_cast<float>(0), std::min(value, BYTEMAXIMUMVALUEFL));
+    return static_cast<uint8_t>(value);
+}
+
+void ColorMatrixFilter::Process(Image& image) {
+    if (image.GetFormat() == EPixelFormat::Luma) {
+        ProcessLuma(image);
+        return;
+    }
+    if (!has_matrix_) {
+        pre_.Process(image);
+        return;
+    }
+    if (is_gray_) {
+        ProcessGray(image);
+        return;
+    }
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        for (Pixel& temp_p : image.GetRowSpan(row)) {
+            uint8_t r = pre_.MapChannel(RED_CHANNEL, temp_p.R);
+            uint8_t g = pre_.MapChannel(GREEN_CHANNEL, temp_p.G);
+            uint8_t b = pre_.MapChannel(BLUE_CHANNEL, temp_p.B);
+            temp_p = Pixel{post_.MapChannel(RED_CHANNEL, ApplyMatrix(RED_CHANNEL, r, g, b)),
+                           post_.MapChannel(GREEN_CHANNEL, ApplyMatrix(GREEN_CHANNEL, r, g, b)),
+                           post_.MapChannel(BLUE_CHANNEL, ApplyMatrix(BLUE_CHANNEL, r, g, b))};
+        }
+    }
+}
+
+const char* ColorMatrixFilter::GetName() const {
+    return "color matrix";
+}
+
+void ColorMatrixFilter::ProcessGray(Image& image) {
+    const LumaRowKernel kernel = GetLumaRowKernel();
+    const size_t width = static_cast<size_t>(image.GetWidth());
+    const LumaCoefficients coefficients = matrix_[RED_CHANNEL];
+    /* Equal output channels turn the image into luma. Luma row i ends before RGB row i + 1 starts, and row i
+       itself has been read into `gray` by then, so the conversion runs in place. */
+    const bool to_luma = post_.IsUniform();
+    AlignedBuffer<uint8_t> gray(width);
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        Pixel* pixels = image.GetRow(row);
+        if (!pre_.IsIdentity()) {
+            pre_.ProcessRow(pixels, width);
+        }
+        kernel(pixels, gray.data(), width, coefficients, offset_[RED_CHANNEL]);
+        if (to_luma) {
+            if (!post_.IsIdentity()) {
+                for (size_t pixel = 0; pixel < width; ++pixel) {
+                    gray[pixel] = post_.MapChannel(RED_CHANNEL, gray[pixel]);
+                }
+            }
+            std::copy(gray.begin(), gray.end(), image.GetLumaRow(row));
+        } else {
+            for (size_t pixel = 0; pixel < width; ++pixel) {
+                pixels[pixel] = Pixel{post_.MapChannel(RED_CHANNEL, gray[pixel]),
+                                      post_.MapChannel(GREEN_CHANNEL, gray[pixel]),
+                                      post_.MapChannel(BLUE_CHANNEL, gray[pixel])};
+            }
+        }
+    }
+    if (to_luma) {
+        image.SetFormat(EPixelFormat::Luma);
+    }
+}
+
+LookupTable ColorMatrixFilter::GetGrayInputTables() const {
+    std::array<Pixel, LOOKUP_TABLE_SIZE> pixels;
+    for (size_t value = 0; value < LOOKUP_TABLE_SIZE; ++value) {
+        const uint8_t byte = static_cast<uint8_t>(value);
+        pixels[value] = Pixel{pre_.MapChannel(RED_CHANNEL, byte), pre_.MapChannel(GREEN_CHANNEL, byte),
+                              pre_.MapChannel(BLUE_CHANNEL, byte)};
+    }
+    std::array<uint8_t, LOOKUP_TABLE_SIZE> gray;
+    if (IsGray()) {
+        /* Through the same kernel as ProcessGray, so luma and RGB images give the same bytes */
+        GetLumaRowKernel()(pixels.data(), gray.data(), LOOKUP_TABLE_SIZE, matrix_[RED_CHANNEL], offset_[RED_CHANNEL]);
+    }
+    LookupTable tables;
+    for (size_t value = 0; value < LOOKUP_TABLE_SIZE; ++value) {
+        const Pixel& pixel = pixels[value];
+        const uint8_t channels[CHANNELS] = {pixel.R, pixel.G, pixel.B};
+        for (size_t channel = 0; channel < CHANNELS; ++channel) {
+            if (!has_matrix_) {
+                tables[channel][value] = channels[channel];
+            } else if (is_gray_) {
+                tables[channel][value] = post_.MapChannel(channel, gray[value]);
+            } else {
+                tables[channel][value] = post_.MapChannel(channel, ApplyMatrix(channel, pixel.R, pixel.G, pixel.B));
+            }
+        }
+    }
+    return tables;
+}
+
+/* A luma pixel is a single byte, so the whole stage reduces to a table per output channel. When the three tables
+   agree the image stays luma, otherwise it is expanded once and mapped as RGB. */
+void ColorMatrixFilter::ProcessLuma(Image& image) {
+    const LookupTable tables = GetGrayInputTables();
+    if (tables[RED_CHANNEL] != tables[GREEN_CHANNEL] || tables[RED_CHANNEL] != tables[BLUE_CHANNEL]) {
+        LookupTableFilter expand;
+        expand.SetTable(tables);
+        expand.Process(image);
+        return;
+    }
+    const auto& table = tables[RED_CHANNEL];
+    for (int32_t row = 0; row < image.GetHeight(); ++row) {
+        uint8_t* luma = image.GetLumaRow(row);
+        for (int32_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
+            luma[pixel] = table[luma[pixel]];
+        }
+    }
+}
+
+void ColorMatrixFilter::Append(const ChannelFilter& filter) {
+    if (has_matrix_) {
+        post_.Append(filter);
+    } else {
+        pre_.Append(filter);
+    }
+}
+
+bool ColorMatrixFilter::Append(const ColorMatrixFilter& filter) {
+    if (!filter.has_matrix_) {
+        Append(filter.pre_);
+        return true;
+    }
+    if (!has_matrix_) {
+        pre_.Append(filter.pre_);
+        SetMatrix(filter.matrix_, filter.offset_);
+        post_ = filter.post_;
+        return true;
+    }
+    if (!is_gray_) {
+        return false;
+    }
+    /* Our output is a function of a single gray byte, so the whole of `filter` becomes a table over it */
+    LookupTable table;
+    for (size_t gray = 0; gray < LOOKUP_TABLE_SIZE; ++gray) {
+        uint8_t r = filter.pre_.MapChannel(RED_CHANNEL, post_.MapChannel(RED_CHANNEL, static_cast<uint8_t>(gray)));
+        uint8_t g =
+            filter.pre_.MapChannel(GREEN_CHANNEL, post_.MapChannel(GREEN_CHANNEL, static_cast<uint8_t>(gray)));
+        uint8_t b = filter.pre_.MapChannel(BLUE_CHANNEL, post_.MapChannel(BLUE_CHANNEL, static_cast<uint8_t>(gray)));
+        for (size_t channel = 0; channel < CHANNELS; ++channel) {
+            table[channel][gray] = filter.post_.MapChannel(channel, filter.ApplyMatrix(channel, r, g, b));
+        }
+    }
+    post_.SetTable(table);
+    return true;
+}
+
+GrayscaleFilter::GrayscaleFilter() {
+    const std::array<float, CHANNELS> gray = {REDTOGRAYCOEF, GREENTOGRAYCOEF, BLUETOGRAYCOEF};
+    SetMatrix({gray, gray, gray}, {0, 0, 0});
+}
+
+const char* GrayscaleFilter::GetName() const {
+    return "grayscale";
+}
+
 void MatrixFilter::SetMatrix(std::vector<int32_t>& row_1, std::vector<int32_t>& row_2, std::vector<int32_t>& row_3) {
     matrix_.emplace_back(row_1);
     matrix_.emplace_back(row_2);
@@ -58,74 +333,29 @@ void MatrixFilter::SetMatrix(std::vector<int32_t>& row_1, std::vector<int32_t>&
 }
 
 void MatrixFilter::MatrixProcess(Image& image) {
-    matrix_image_.resize(image.GetHeight());
-    for (int32_t row = 0; row < image.GetHeight(); ++row) {
-        for (int32_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            size_t row1 = static_cast<size_t>(std::max(0, row - 1));
-            size_t row2 = static_cast<size_t>(row);
-            size_t row3 = static_cast<size_t>(std::min(image.GetHeight() - 1, row + 1));
-            size_t pixel1 = static_cast<size_t>(std::max(0, pixel - 1));
-            size_t pixel2 = static_cast<size_t>(pixel);
-            size_t pixel3 = static_cast<size_t>(std::min(image.GetWidth() - 1, pixel + 1));
-
-            int32_t temp_r =
-                std::min(static_cast<int32_t>(BYTEMAXIMUMVALUE),
-                         std::max(0, matrix_[0][0] * static_cast<int32_t>(image.GetPixel(row1, pixel1).R) +
-                                         matrix_[0][1] * static_cast<int32_t>(image.GetPixel(row1, pixel2).R) +
-                                         matrix_[0][2] * static_cast<int32_t>(image.GetPixel(row1, pixel3).R) +
-
-                                         matrix_[1][0] * static_cast<int32_t>(image.GetPixel(row2, pixel1).R) +
-                                         matrix_[1][1] * static_cast<int32_t>(image.GetPixel(row2, pixel2).R) +
-                                         matrix_[1][2] * static_cast<int32_t>(image.GetPixel(row2, pixel3).R) +
-
-                                         matrix_[2][0] * static_cast<int32_t>(image.GetPixel(row3, pixel1).R) +
-                                         matrix_[2][1] * static_cast<int32_t>(image.GetPixel(row3, pixel2).R) +
-                                         matrix_[2][2] * static_cast<int32_t>(image.GetPixel(row3, pixel3).R)));
-            int32_t temp_g =
-                std::min(static_cast<int32_t>(BYTEMAXIMUMVALUE),
-                         std::max(0, matrix_[0][0] * static_cast<int32_t>(image.GetPixel(row1, pixel1).G) +
-                                         matrix_[0][1] * static_cast<int32_t>(image.GetPixel(row1, pixel2).G) +
-                                         matrix_[0][2] * static_cast<int32_t>(image.GetPixel(row1, pixel3).G) +
-
-                                         matrix_[1][0] * static_cast<int32_t>(image.GetPixel(row2, pixel1).G) +
-                                         matrix_[1][1] * static_cast<int32_t>(image.GetPixel(row2, pixel2).G) +
-                                         matrix_[1][2] * static_cast<int32_t>(image.GetPixel(row2, pixel3).G) +
-
-                                         matrix_[2][0] * static_cast<int32_t>(image.GetPixel(row3, pixel1).G) +
-                                         matrix_[2][1] * static_cast<int32_t>(image.GetPixel(row3, pixel2).G) +
-                                         matrix_[2][2] * static_cast<int32_t>(image.GetPixel(row3, pixel3).G)));
-            int32_t temp_b =
-                std::min(static_cast<int32_t>(BYTEMAXIMUMVALUE),
-                         std::max(0, matrix_[0][0] * static_cast<int32_t>(image.GetPixel(row1, pixel1).B) +
-                                         matrix_[0][1] * static_cast<int32_t>(image.GetPixel(row1, pixel2).B) +
-                                         matrix_[0][2] * static_cast<int32_t>(image.GetPixel(row1, pixel3).B) +
-
-                                         matrix_[1][0] * static_cast<int32_t>(image.GetPixel(row2, pixel1).B) +
-                                         matrix_[1][1] * static_cast<int32_t>(image.GetPixel(row2, pixel2).B) +
-                                         matrix_[1][2] * static_cast<int32_t>(image.GetPixel(row2, pixel3).B) +
-
-                                         matrix_[2][0] * static_cast<int32_t>(image.GetPixel(row3, pixel1).B) +
-                                         matrix_[2][1] * static_cast<int32_t>(image.GetPixel(row3, pixel2).B) +
-                                         matrix_[2][2] * static_cast<int32_t>(image.GetPixel(row3, pixel3).B)));
-            Pixel matrix_use_result;
-            matrix_use_result.SetColor32(temp_r, temp_g, temp_b);
-            matrix_image_[row].emplace_back(matrix_use_result);
+    image.ToRgb();
+    Convolve(image, [this](const Pixel* const* rows, const int32_t* columns, int32_t& r, int32_t& g, int32_t& b) {
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t j = 0; j < 3; ++j) {
+                const Pixel& neighbour = rows[i][columns[j]];
+                r += matrix_[i][j] * static_cast<int32_t>(neighbour.R);
+                g += matrix_[i][j] * static_cast<int32_t>(neighbour.G);
+                b += matrix_[i][j] * static_cast<int32_t>(neighbour.B);
+            }
         }
-    }
+    });
 }
 
 void SharpeningFilter::Process(Image& image) {
-    std::vector<int32_t> row1 = {0, -1, 0};
-    std::vector<int32_t> row2 = {-1, SHARPENINGCOEF, -1};
-    std::vector<int32_t> row3 = {0, -1, 0};
-    SetMatrix(row1, row2, row3);
-    MatrixProcess(image);
-    for (size_t row = 0; row < image.GetHeight(); ++row) {
-        for (size_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            image.SetPixel(row, pixel, matrix_image_[row][pixel].R, matrix_image_[row][pixel].G,
-                           matrix_image_[row][pixel].B);
-        }
-    }
+    MatrixProcess<SHARPENINGKERNEL>(image);
+}
+
+const char* SharpeningFilter::GetName() const {
+    return "sharpening";
+}
+
+bool SharpeningFilter::WritesInPlace() const {
+    return false;
 }
 
 void EdgeDetectionFilter::SetThreshold(float& threshold) {
@@ -133,55 +363,227 @@ void EdgeDetectionFilter::SetThreshold(float& threshold) {
 }
 
 void EdgeDetectionFilter::Process(Image& image) {
-    std::vector<int32_t> row1 = {0, -1, 0};
-    std::vector<int32_t> row2 = {-1, EDGEDETECTIONCOEF, -1};
-    std::vector<int32_t> row3 = {0, -1, 0};
-    SetMatrix(row1, row2, row3);
-    GrayscaleFilter grayscale;
-    grayscale.Process(image);
-    MatrixProcess(image);
-    uint8_t white = WHITE;
-    uint8_t black = BLACK;
-    for (size_t row = 0; row < image.GetHeight(); ++row) {
-        for (size_t pixel = 0; pixel < image.GetWidth(); ++pixel) {
-            if (matrix_image_[row][pixel].R > static_cast<uint8_t>(threshold_ * BYTEMAXIMUMVALUEFL)) {
-                image.SetPixel(row, pixel, white, white, white);
-            } else {
-                image.SetPixel(row, pixel, black, black, black);
-            }
+    const int32_t height = image.GetHeight();
+    const int32_t width = image.GetWidth();
+    if (width == 0 || height == 0) {
+        return;
+    }
+    const LumaRowKernel kernel = GetLumaRowKernel();
+    const LumaCoefficients coefficients = {REDTOGRAYCOEF, GREENTOGRAYCOEF, BLUETOGRAYCOEF};
+    const uint8_t threshold = static_cast<uint8_t>(threshold_ * BYTEMAXIMUMVALUEFL);
+    auto edge_value = [threshold](const uint8_t* const* rows, int32_t left, int32_t center, int32_t right) {
+        const int32_t columns[3] = {left, center, right};
+        const int32_t sum = AccumulateLumaTaps<EDGEDETECTIONKERNEL>(rows, columns);
+        const int32_t maximum = BYTEMAXIMUMVALUE;
+        return std::clamp(sum, 0, maximum) > threshold ? WHITE : BLACK;
+    };
+    /* A luma input only needs the per-byte table of what the kernel gives for a gray pixel */
+    const bool is_luma = image.GetFormat() == EPixelFormat::Luma;
+    std::array<uint8_t, LOOKUP_TABLE_SIZE> gray_luma;
+    if (is_luma) {
+        std::array<Pixel, LOOKUP_TABLE_SIZE> grays;
+        for (size_t value = 0; value < LOOKUP_TABLE_SIZE; ++value) {
+            const uint8_t byte = static_cast<uint8_t>(value);
+            grays[value] = Pixel{byte, byte, byte};
         }
+        kernel(grays.data(), gray_luma.data(), LOOKUP_TABLE_SIZE, coefficients, 0);
     }
+    image.PrepareBackBuffer();
+
+    /* Every band keeps the luma of the three source rows around its current row in a ring, recomputing the one row
+       above and below the band that a neighbouring band also needs */
+    GetThreadPool().ParallelFor(height, GetChunkSize(height), [&](size_t begin, size_t end) {
+        const size_t columns = static_cast<size_t>(width);
+        AlignedBuffer<uint8_t> ring(3 * columns);
+        auto ring_row = [&](int32_t row) { return ring.data() + static_cast<size_t>(row % 3) * columns; };
+
+        int32_t next_luma_row = std::max(0, static_cast<int32_t>(begin) - 1);
+        for (int32_t row = static_cast<int32_t>(begin); row < static_cast<int32_t>(end); ++row) {
+            for (; next_luma_row <= std::min(height - 1, row + 1); ++next_luma_row) {
+                uint8_t* luma = ring_row(next_luma_row);
+                if (is_luma) {
+                    const uint8_t* source = image.GetLumaRow(next_luma_row);
+                    for (size_t pixel = 0; pixel < columns; ++pixel) {
+                        luma[pixel] = gray_luma[source[pixel]];
+                    }
+                } else {
+                    kernel(image.GetRow(next_luma_row), luma, columns, coefficients, 0);
+                }
+            }
+            const uint8_t* rows[3] = {ring_row(std::max(0, row - 1)), ring_row(row),
+                                      ring_row(std::min(height - 1, row + 1))};
+            /* Border columns split off as in MatrixFilter::ConvolveLuma */
+            const int32_t last = width - 1;
+            const auto edge = edge_value;
+            uint8_t* edge_row = image.GetBackLumaRow(row);
+            edge_row[0] = edge(rows, 0, 0, std::min(last, 1));
+            for (int32_t pixel = 1; pixel < last; ++pixel) {
+                edge_row[pixel] = edge(rows, pixel - 1, pixel, pixel + 1);
+            }
+            edge_row[last] = edge(rows, std::max(0, last - 1), last, last);
+        }
+    });
+    image.SwapBuffers();
+    image.SetFormat(EPixelFormat::Luma);
+}
+
+const char* EdgeDetectionFilter::GetName() const {
+    return "edge detection";
+}
+
+bool EdgeDetectionFilter::WritesInPlace() const {
+    return false;
 }
 
 void GaussianBlurFilter::SetSigma(float& sigma) {
     sigma_ = sigma;
 }
 
+int32_t GaussianBlurFilter::GetRadius() const {
+    if (!(sigma_ > 0)) {
+        return 0;
+    }
+    return static_cast<int32_t>(std::ceil(GAUSSIANRADIUSCOEF * std::min(sigma_, GAUSSIANMAXSIGMA)));
+}
+
+std::vector<float> GaussianBlurFilter::GetWeights() const {
+    const int32_t radius = GetRadius();
+    std::vector<float> weights(static_cast<size_t>(radius) + 1);
+    double sum = 0;
+    for (int32_t i = 0; i <= radius; ++i) {
+        double weight = std::exp(-static_cast<double>(i) * i / (2.0 * sigma_ * sigma_));
+        weights[i] = static_cast<float>(weight);
+        sum += i == 0 ? weight : 2 * weight;
+    }
+    for (float& weight : weights) {
+        weight = static_cast<float>(weight / sum);
+    }
+    return weights;
+}
+
+void GaussianBlurFilter::BlurRowHorizontally(const float* padded, size_t values, size_t channels,
+                                             const std::vector<float>& weights, float tail, float* result) const {
+    const size_t radius = weights.size() - 1;
+    /* Channels are interleaved, so the neighbour k pixels away is k * channels values away */
+    const float* center = padded + radius * channels;
+    for (size_t i = 0; i < values; ++i) {
+        result[i] = weights[0] * center[i];
+    }
+    for (size_t k = 1; k <= radius; ++k) {
+        const float weight = weights[k];
+        const float* left = center - k * channels;
+        const float* right = center + k * channels;
+        for (size_t i = 0; i < values; ++i) {
+            result[i] += weight * (left[i] + right[i]);
+        }
+    }
+    if (tail > 0) {
+        const float* last = center + values - channels;
+        for (size_t i = 0; i < values; i += channels) {
+            for (size_t channel = 0; channel < channels; ++channel) {
+                result[i + channel] += tail * (center[channel] + last[channel]);
+            }
+        }
+    }
+}
+
 void GaussianBlurFilter::Process(Image& image) {
-    for (size_t row = 1; row < image.GetHeight() - 1; ++row) {
-        for (size_t pixel = 1; pixel < image.GetWidth() - 1; ++pixel) {
-            int32_t r = 0;
-            int32_t g = 0;
-            int32_t b = 0;
-            r = (image.GetPixel(row - 1, pixel - 1).R + image.GetPixel(row - 1, pixel).R +
-                 image.GetPixel(row - 1, pixel + 1).R + image.GetPixel(row, pixel - 1).R +
-                 image.GetPixel(row, pixel).R + image.GetPixel(row, pixel + 1).R +
-                 image.GetPixel(row + 1, pixel - 1).R + image.GetPixel(row + 1, pixel).R +
-                 image.GetPixel(row + 1, pixel + 1).R) /
-                SMOOTHCOEF;
-            g = (image.GetPixel(row - 1, pixel - 1).G + image.GetPixel(row - 1, pixel).G +
-                 image.GetPixel(row - 1, pixel + 1).G + image.GetPixel(row, pixel - 1).G +
-                 image.GetPixel(row, pixel).G + image.GetPixel(row, pixel + 1).G +
-                 image.GetPixel(row + 1, pixel - 1).G + image.GetPixel(row + 1, pixel).G +
-                 image.GetPixel(row + 1, pixel + 1).G) /
-                SMOOTHCOEF;
-            b = (image.GetPixel(row - 1, pixel - 1).B + image.GetPixel(row - 1, pixel).B +
-                 image.GetPixel(row - 1, pixel + 1).B + image.GetPixel(row, pixel - 1).B +
-                 image.GetPixel(row, pixel).B + image.GetPixel(row, pixel + 1).B +
-                 image.GetPixel(row + 1, pixel - 1).B + image.GetPixel(row + 1, pixel).B +
-                 image.GetPixel(row + 1, pixel + 1).B) /
-                SMOOTHCOEF;
-            image.SetPixel32(row, pixel, r, g, b);
+    const int32_t radius = GetRadius();
+    const int32_t width = image.GetWidth();
+    const int32_t height = image.GetHeight();
+    if (radius == 0 || width == 0 || height == 0) {
+        return;
+    }
+    const std::vector<float> weights = GetWeights();
+    /* A luma image is blurred as a single channel */
+    const bool is_luma = image.GetFormat() == EPixelFormat::Luma;
+    const size_t channels = is_luma ? 1 : CHANNELS;
+    const size_t values = static_cast<size_t>(width) * channels;
+
+    /* Taps further away than the image is wide or tall only ever reach the replicated edge pixel, so their weights
+       are folded into the edge and neither the padding nor the ring outgrows the image */
+    auto folded_weight = [&weights](int32_t kept) {
+        double sum = 0;
+        for (size_t i = static_cast<size_t>(kept) + 1; i < weights.size(); ++i) {
+            sum += weights[i];
+        }
+        return static_cast<float>(sum);
+    };
+    const int32_t row_radius = std::min(radius, width - 1);
+    const int32_t column_radius = std::min(radius, height - 1);
+    const std::vector<float> row_weights(weights.begin(), weights.begin() + row_radius + 1);
+    const float row_tail = folded_weight(row_radius);
+    const float column_tail = folded_weight(column_radius);
+    const int32_t ring_rows = std::min(2 * column_radius + 1, height);
+
+    AlignedBuffer<float> padded(static_cast<size_t>(width + 2 * row_radius) * channels);
+    AlignedBuffer<float> ring(static_cast<size_t>(ring_rows) * values);
+    AlignedBuffer<float> accumulator(values);
+    auto ring_row = [&](int32_t row) { return ring.data() + static_cast<size_t>(row % ring_rows) * values; };
+    auto pad_row = [&](int32_t row) {
+        for (int32_t pixel = -row_radius; pixel < width + row_radius; ++pixel) {
+            const int32_t column = std::clamp(pixel, 0, width - 1);
+            float* destination = padded.data() + static_cast<size_t>(pixel + row_radius) * channels;
+            if (is_luma) {
+                destination[0] = image.GetLumaRow(row)[column];
+            } else {
+                const Pixel& source = image.GetRow(row)[column];
+                destination[RED_CHANNEL] = source.R;
+                destination[GREEN_CHANNEL] = source.G;
+                destination[BLUE_CHANNEL] = source.B;
+            }
+        }
+    };
+
+    /* Output row `row` needs the horizontal results of rows row - radius .. row + radius, which all fit in the
+       ring, as do the first and the last row whenever a folded tail needs them. Its own source row is consumed
+       before it is overwritten, so the result goes back in place. */
+    int32_t blurred_rows = 0;
+    for (int32_t row = 0; row < height; ++row) {
+        for (; blurred_rows <= std::min(height - 1, row + column_radius); ++blurred_rows) {
+            pad_row(blurred_rows);
+            BlurRowHorizontally(padded.data(), values, channels, row_weights, row_tail, ring_row(blurred_rows));
+        }
+
+        const float* center = ring_row(row);
+        for (size_t i = 0; i < values; ++i) {
+            accumulator[i] = weights[0] * center[i];
+        }
+        for (int32_t k = 1; k <= column_radius; ++k) {
+            const float weight = weights[k];
+            const float* above = ring_row(std::max(0, row - k));
+            const float* below = ring_row(std::min(height - 1, row + k));
+            for (size_t i = 0; i < values; ++i) {
+                accumulator[i] += weight * (above[i] + below[i]);
+            }
+        }
+        if (column_tail > 0) {
+            const float* first = ring_row(0);
+            const float* last = ring_row(height - 1);
+            for (size_t i = 0; i < values; ++i) {
+                accumulator[i] += column_tail * (first[i] + last[i]);
+            }
+        }
+
+        if (is_luma) {
+            uint8_t* out = image.GetLumaRow(row);
+            const int32_t maximum = BYTEMAXIMUMVALUE;
+            for (int32_t pixel = 0; pixel < width; ++pixel) {
+                out[pixel] = static_cast<uint8_t>(std::clamp(static_cast<int32_t>(accumulator[pixel] + 0.5f), 0, maximum));
+            }
+            continue;
+        }
+        Pixel* out = image.GetRow(row);
+        for (int32_t pixel = 0; pixel < width; ++pixel) {
+            const float* value = accumulator.data() + static_cast<size_t>(pixel) * CHANNELS;
+            int32_t r = static_cast<int32_t>(value[RED_CHANNEL] + 0.5f);
+            int32_t g = static_cast<int32_t>(value[GREEN_CHANNEL] + 0.5f);
+            int32_t b = static_cast<int32_t>(value[BLUE_CHANNEL] + 0.5f);
+            out[pixel].SetColor32(r, g, b);
         }
     }
 }
+
+const char* GaussianBlurFilter::GetName() const {
+    return "gaussian blur";
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include "image_processor.h"
+#include "luma_kernels.h"
+#include "thread_pool.h"
+#include <array>
 #include <cmath>
 const float REDTOGRAYCOEF = 0.299;
 const float GREENTOGRAYCOEF = 0.587;
@@ -10,61 +13,296 @@ const uint8_t WHITE = 255;
 const uint8_t BLACK = 0;
 const int32_t DEPTH = 17;
 const int32_t INTENSITY = 23;
-const int32_t SMOOTHCOEF = 9;
+const float GAUSSIANRADIUSCOEF = 3; /* Kernel radius in sigmas, the tail beyond it is below 0.5% of the weight */
+const float GAUSSIANMAXSIGMA = 100000; /* Larger sigmas are rejected, the radius is capped there as well */
+const size_t CHANNELS = 3;
+const size_t RED_CHANNEL = 0;
+const size_t GREEN_CHANNEL = 1;
+const size_t BLUE_CHANNEL = 2;
+const size_t LOOKUP_TABLE_SIZE = 256;
 
 class AbstractFilter {
 public:
+    virtual ~AbstractFilter() = default;
     virtual void Process(Image& image) = 0;
+    /* Short stage name for reports such as --profile */
+    virtual const char* GetName() const = 0;
+    /* Whether Process writes the front buffer of the image, which then must not be shared (see Image::Share) */
+    virtual bool WritesInPlace() const {
+        return true;
+    }
 };
 
-class GrayscaleFilter : public AbstractFilter {
+class CropFilter : public AbstractFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
+    bool WritesInPlace() const override;
+    void SetSize(int32_t& width, int32_t& height);
+    void SetOrigin(int32_t& x, int32_t& y);
+    int32_t x_ = 0;
+    int32_t y_ = 0;
+    int32_t width_;
+    int32_t height_;
 };
 
-class SepiaFilter : public AbstractFilter {
+/* Filter where every output channel depends only on the same input channel */
+class ChannelFilter : public AbstractFilter {
+public:
+    virtual uint8_t MapChannel(size_t channel, uint8_t value) const = 0;
+};
+
+class SepiaFilter : public ChannelFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
+    uint8_t MapChannel(size_t channel, uint8_t value) const override;
 };
 
-class ContrastFilter : public AbstractFilter {
+class ContrastFilter : public ChannelFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
+    uint8_t MapChannel(size_t channel, uint8_t value) const override;
     void SetCoef(float& coef);
     float coef_;
 };
 
-class NegativeFilter : public AbstractFilter {
+class NegativeFilter : public ChannelFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
+    uint8_t MapChannel(size_t channel, uint8_t value) const override;
 };
 
-class MatrixFilter : public AbstractFilter {
+using LookupTable = std::array<std::array<uint8_t, LOOKUP_TABLE_SIZE>, CHANNELS>;
+
+/* A run of channel filters composed into one 256-entry table per channel and applied in a single pass */
+class LookupTableFilter : public ChannelFilter {
 public:
-    std::vector<std::vector<Pixel>> matrix_image_;
+    LookupTableFilter();
+    void Process(Image& image) override;
+    const char* GetName() const override;
+    uint8_t MapChannel(size_t channel, uint8_t value) const override;
+    void ProcessRow(Pixel* row, size_t width) const;
+    void Append(const ChannelFilter& filter);
+    void SetTable(const LookupTable& table);
+    bool IsIdentity() const;
+    /* The same table for all three channels, so gray pixels stay gray */
+    bool IsUniform() const;
+
+private:
+    LookupTable table_;
+    bool is_identity_ = true;
+};
+
+using ColorMatrix = std::array<std::array<float, CHANNELS>, CHANNELS>;
+using ColorOffset = std::array<float, CHANNELS>;
 
+/* Affine colour transform: a per-channel table, then out = matrix * in + offset clamped and truncated to a byte
+   the way Pixel::SetColorFl does, then another per-channel table. The clamp points between the three parts keep
+   composition exact, so Append refuses anything that cannot be folded without changing the result. */
+class ColorMatrixFilter : public AbstractFilter {
+public:
+    void Process(Image& image) override;
+    const char* GetName() const override;
+    void SetMatrix(const ColorMatrix& matrix, const ColorOffset& offset);
+    bool HasMatrix() const;
+    /* All output channels of the matrix are equal, so everything after it only depends on one byte */
+    bool IsGray() const;
+    void Append(const ChannelFilter& filter);
+    bool Append(const ColorMatrixFilter& filter);
+
+private:
+    uint8_t ApplyMatrix(size_t channel, uint8_t r, uint8_t g, uint8_t b) const;
+    /* What every channel becomes for a gray input pixel, per input byte */
+    LookupTable GetGrayInputTables() const;
+    void ProcessGray(Image& image);
+    void ProcessLuma(Image& image);
+
+    LookupTableFilter pre_;
+    LookupTableFilter post_;
+    bool has_matrix_ = false;
+    bool is_gray_ = false;
+    ColorMatrix matrix_;
+    ColorOffset offset_;
+};
+
+class GrayscaleFilter : public ColorMatrixFilter {
+public:
+    GrayscaleFilter();
+    const char* GetName() const override;
+};
+
+struct TKernel3x3 {
+    std::array<std::array<int32_t, 3>, 3> Taps;
+};
+
+constexpr TKernel3x3 SHARPENINGKERNEL = {{{{0, -1, 0}, {-1, SHARPENINGCOEF, -1}, {0, -1, 0}}}};
+constexpr TKernel3x3 EDGEDETECTIONKERNEL = {{{{0, -1, 0}, {-1, EDGEDETECTIONCOEF, -1}, {0, -1, 0}}}};
+
+class MatrixFilter : public AbstractFilter {
+public:
     void SetMatrix(std::vector<int32_t>& row_1, std::vector<int32_t>& row_2, std::vector<int32_t>& row_3);
+    /* Generic path for kernels only known at run time, set through SetMatrix */
+    void MatrixProcess(Image& image);
+    /* Kernels known at compile time: zero taps vanish and the remaining ones are fully unrolled */
+    template <TKernel3x3 Kernel>
     void MatrixProcess(Image& image);
 
 private:
+    /* Calls accumulate(rows, columns, r, g, b) for every pixel with the three source rows and columns around it,
+       edge pixels replicated, and stores the clamped sums. The interior runs without any index clamping. The result
+       is written to the back buffer of the image, which then becomes the front one. */
+    template <typename Accumulate>
+    void Convolve(Image& image, Accumulate accumulate);
+    /* The same for a luma image, convolving its single channel */
+    template <TKernel3x3 Kernel>
+    void ConvolveLuma(Image& image);
+
     std::vector<std::vector<int32_t>> matrix_;
 };
 
-class SharpeningFilter : MatrixFilter {
+template <TKernel3x3 Kernel, size_t Tap = 0>
+inline void AccumulateTaps(const Pixel* const* rows, const int32_t* columns, int32_t& r, int32_t& g, int32_t& b) {
+    if constexpr (Tap < 9) {
+        constexpr int32_t weight = Kernel.Taps[Tap / 3][Tap % 3];
+        if constexpr (weight != 0) {
+            const Pixel& neighbour = rows[Tap / 3][columns[Tap % 3]];
+            r += weight * static_cast<int32_t>(neighbour.R);
+            g += weight * static_cast<int32_t>(neighbour.G);
+            b += weight * static_cast<int32_t>(neighbour.B);
+        }
+        AccumulateTaps<Kernel, Tap + 1>(rows, columns, r, g, b);
+    }
+}
+
+template <TKernel3x3 Kernel, size_t Tap = 0>
+inline int32_t AccumulateLumaTaps(const uint8_t* const* rows, const int32_t* columns) {
+    if constexpr (Tap < 9) {
+        constexpr int32_t weight = Kernel.Taps[Tap / 3][Tap % 3];
+        int32_t sum = AccumulateLumaTaps<Kernel, Tap + 1>(rows, columns);
+        if constexpr (weight != 0) {
+            sum += weight * static_cast<int32_t>(rows[Tap / 3][columns[Tap % 3]]);
+        }
+        return sum;
+    } else {
+        return 0;
+    }
+}
+
+template <typename Accumulate>
+void MatrixFilter::Convolve(Image& image, Accumulate accumulate) {
+    const int32_t height = image.GetHeight();
+    const int32_t width = image.GetWidth();
+    image.PrepareBackBuffer();
+
+    auto convolve_pixel = [&accumulate](const Pixel* const* rows, int32_t left, int32_t center, int32_t right,
+                                        Pixel& out) {
+        const int32_t columns[3] = {left, center, right};
+        int32_t temp_r = 0;
+        int32_t temp_g = 0;
+        int32_t temp_b = 0;
+        accumulate(rows, columns, temp_r, temp_g, temp_b);
+        const int32_t maximum = BYTEMAXIMUMVALUE;
+        out = Pixel{static_cast<uint8_t>(std::clamp(temp_r, 0, maximum)),
+                    static_cast<uint8_t>(std::clamp(temp_g, 0, maximum)),
+                    static_cast<uint8_t>(std::clamp(temp_b, 0, maximum))};
+    };
+
+    /* Output rows only depend on the source, so bands of rows are convolved concurrently */
+    GetThreadPool().ParallelFor(height, GetChunkSize(height), [&](size_t begin, size_t end) {
+        for (int32_t row = static_cast<int32_t>(begin); row < static_cast<int32_t>(end); ++row) {
+            /* Rows beyond the top and bottom edges replicate the edge row once per row, not per pixel */
+            const Pixel* rows[3] = {image.GetRow(std::max(0, row - 1)), image.GetRow(row),
+                                    image.GetRow(std::min(height - 1, row + 1))};
+            Pixel* out = image.GetBackRow(row);
+            if (width == 1) {
+                convolve_pixel(rows, 0, 0, 0, out[0]);
+                continue;
+            }
+            /* Only the first and last columns need their neighbours clamped */
+            convolve_pixel(rows, 0, 0, 1, out[0]);
+            for (int32_t pixel = 1; pixel < width - 1; ++pixel) {
+                convolve_pixel(rows, pixel - 1, pixel, pixel + 1, out[pixel]);
+            }
+            convolve_pixel(rows, width - 2, width - 1, width - 1, out[width - 1]);
+        }
+    });
+    image.SwapBuffers();
+}
+
+template <TKernel3x3 Kernel>
+void MatrixFilter::ConvolveLuma(Image& image) {
+    const int32_t height = image.GetHeight();
+    const int32_t width = image.GetWidth();
+    image.PrepareBackBuffer();
+
+    GetThreadPool().ParallelFor(height, GetChunkSize(height), [&image, height, width](size_t begin, size_t end) {
+        /* The bound is a local, byte stores could alias anything reached through a reference */
+        const int32_t last = width - 1;
+        auto convolve = [](const uint8_t* const* rows, int32_t left, int32_t center, int32_t right) {
+            const int32_t columns[3] = {left, center, right};
+            const int32_t maximum = BYTEMAXIMUMVALUE;
+            return static_cast<uint8_t>(std::clamp(AccumulateLumaTaps<Kernel>(rows, columns), 0, maximum));
+        };
+        for (int32_t row = static_cast<int32_t>(begin); row < static_cast<int32_t>(end); ++row) {
+            const uint8_t* rows[3] = {image.GetLumaRow(std::max(0, row - 1)), image.GetLumaRow(row),
+                                      image.GetLumaRow(std::min(height - 1, row + 1))};
+            uint8_t* out = image.GetBackLumaRow(row);
+            out[0] = convolve(rows, 0, 0, std::min(last, 1));
+            for (int32_t pixel = 1; pixel < last; ++pixel) {
+                out[pixel] = convolve(rows, pixel - 1, pixel, pixel + 1);
+            }
+            out[last] = convolve(rows, std::max(0, last - 1), last, last);
+        }
+    });
+    image.SwapBuffers();
+}
+
+template <TKernel3x3 Kernel>
+void MatrixFilter::MatrixProcess(Image& image) {
+    if (image.GetFormat() == EPixelFormat::Luma) {
+        ConvolveLuma<Kernel>(image);
+        return;
+    }
+    Convolve(image, [](const Pixel* const* rows, const int32_t* columns, int32_t& r, int32_t& g, int32_t& b) {
+        AccumulateTaps<Kernel>(rows, columns, r, g, b);
+    });
+}
+
+class SharpeningFilter : public MatrixFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
+    bool WritesInPlace() const override;
 };
 
-class EdgeDetectionFilter : MatrixFilter {
+/* Grayscale, the edge kernel and the threshold fused into one pass: the kernel runs on a single luma channel
+   computed on the fly, and the black and white result is stored as a luma image */
+class EdgeDetectionFilter : public AbstractFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
+    bool WritesInPlace() const override;
     void SetThreshold(float& threshold);
     float threshold_;
 };
 
-class GaussianBlurFilter : MatrixFilter {
+/* Separable Gaussian: a horizontal pass into a ring of 2 * radius + 1 float rows, but never more than the image
+   has, then a vertical pass over that ring row by row, with edge pixels replicated beyond the border */
+class GaussianBlurFilter : public AbstractFilter {
 public:
     void Process(Image& image) override;
+    const char* GetName() const override;
     void SetSigma(float& sigma);
+    int32_t GetRadius() const;
     float sigma_;
+
+private:
+    std::vector<float> GetWeights() const;
+    /* `padded` holds a row of `values` interleaved values of `channels` channels with `weights.size() - 1`
+       replicated edge pixels on both sides, `tail` is the weight of the taps beyond them folded onto each edge */
+    void BlurRowHorizontally(const float* padded, size_t values, size_t channels, const std::vector<float>& weights,
+                             float tail, float* result) const;
 };
@@ -1,8 +1,98 @@
-#include "filters.h"
+#include "image_processor.h"
+#include "bmp_io.h"
+#include <atomic>
+#include <cstring>
+
+static std::atomic<size_t> buffer_allocations = 0;
+static std::atomic<size_t> buffer_allocated_bytes = 0;
+static std::atomic<size_t> buffer_live_bytes = 0;
+static std::atomic<size_t> buffer_peak_live_bytes = 0;
+
+void CountBufferAllocation(size_t bytes) {
+    ++buffer_allocations;
+    buffer_allocated_bytes += bytes;
+    const size_t live = buffer_live_bytes += bytes;
+    size_t peak = buffer_peak_live_bytes;
+    while (live > peak && !buffer_peak_live_bytes.compare_exchange_weak(peak, live)) {
+    }
+}
+
+void CountBufferRelease(size_t bytes) {
+    buffer_live_bytes -= bytes;
+}
+
+TBufferStats GetBufferStats() {
+    return {buffer_allocations, buffer_allocated_bytes, buffer_live_bytes, buffer_peak_live_bytes};
+}
+
+void ResetBufferPeak() {
+    buffer_peak_live_bytes = buffer_live_bytes.load();
+}
 
 Image::Image() {
 }
 
+Image::Image(const Image& other)
+    : width_(other.width_),
+      height_(other.height_),
+      stride_(other.stride_),
+      offset_(other.offset_),
+      format_(other.format_),
+      info_header_(other.info_header_),
+      image_(std::make_shared<PixelBuffer>(*other.image_)) {
+}
+
+Image& Image::operator=(const Image& other) {
+    if (this == &other) {
+        return *this;
+    }
+    width_ = other.width_;
+    height_ = other.height_;
+    stride_ = other.stride_;
+    offset_ = other.offset_;
+    format_ = other.format_;
+    info_header_ = other.info_header_;
+    /* A buffer of our own keeps its capacity */
+    if (!shared_) {
+        *image_ = *other.image_;
+    } else {
+        image_ = std::make_shared<PixelBuffer>(*other.image_);
+    }
+    return *this;
+}
+
+Image Image::Share() {
+    shared_ = true;
+    Image shared;
+    shared.width_ = width_;
+    shared.height_ = height_;
+    shared.stride_ = stride_;
+    shared.offset_ = offset_;
+    shared.format_ = format_;
+    shared.info_header_ = info_header_;
+    shared.image_ = image_;
+    shared.shared_ = true;
+    return shared;
+}
+
+void Image::Detach() {
+    if (!shared_) {
+        return;
+    }
+    auto copy = std::make_shared<PixelBuffer>(stride_ * static_cast<size_t>(height_));
+    const bool is_luma = format_ == EPixelFormat::Luma;
+    const size_t row_bytes = static_cast<size_t>(width_) * (is_luma ? 1 : sizeof(Pixel));
+    const size_t stride_bytes = stride_ * (is_luma ? 1 : sizeof(Pixel));
+    uint8_t* destination = reinterpret_cast<uint8_t*>(copy->data());
+    for (int32_t row = 0; row < height_; ++row) {
+        const void* source = is_luma ? static_cast<const void*>(GetLumaRow(row)) : static_cast<const void*>(GetRow(row));
+        std::memcpy(destination + static_cast<size_t>(row) * stride_bytes, source, row_bytes);
+    }
+    image_ = std::move(copy);
+    offset_ = 0;
+    shared_ = false;
+}
+
 int32_t Image::GetHeight() const {
     return height_;
 }
@@ -10,36 +100,125 @@ int32_t Image::GetWidth() const {
     return width_;
 }
 
+size_t Image::GetStride() const {
+    return stride_;
+}
+
+void Image::Resize(int32_t width, int32_t height) {
+    width_ = width;
+    height_ = height;
+    stride_ = (static_cast<size_t>(width) + STRIDE_ALIGNMENT - 1) / STRIDE_ALIGNMENT * STRIDE_ALIGNMENT;
+    offset_ = 0;
+    format_ = EPixelFormat::Rgb;
+    if (!shared_) {
+        image_->resize(stride_ * static_cast<size_t>(height));
+    } else {
+        image_ = std::make_shared<PixelBuffer>(stride_ * static_cast<size_t>(height));
+        shared_ = false;
+    }
+}
+
+Pixel* Image::GetRow(size_t row) {
+    return image_->data() + offset_ + row * stride_;
+}
+const Pixel* Image::GetRow(size_t row) const {
+    return image_->data() + offset_ + row * stride_;
+}
+
+std::span<Pixel> Image::GetRowSpan(size_t row) {
+    return {GetRow(row), static_cast<size_t>(width_)};
+}
+std::span<const Pixel> Image::GetRowSpan(size_t row) const {
+    return {GetRow(row), static_cast<size_t>(width_)};
+}
+
+void Image::PrepareBackBuffer() {
+    back_.resize(image_->size());
+}
+
+Pixel* Image::GetBackRow(size_t row) {
+    return back_.data() + offset_ + row * stride_;
+}
+
+void Image::SwapBuffers() {
+    if (!shared_) {
+        image_->swap(back_);
+        return;
+    }
+    /* The shared front buffer stays with the other images */
+    image_ = std::make_shared<PixelBuffer>(std::move(back_));
+    back_ = PixelBuffer();
+    shared_ = false;
+}
+
+EPixelFormat Image::GetFormat() const {
+    return format_;
+}
+
+void Image::SetFormat(EPixelFormat format) {
+    format_ = format;
+}
+
+uint8_t* Image::GetLumaRow(size_t row) {
+    return reinterpret_cast<uint8_t*>(image_->data()) + offset_ + row * stride_;
+}
+const uint8_t* Image::GetLumaRow(size_t row) const {
+    return reinterpret_cast<const uint8_t*>(image_->data()) + offset_ + row * stride_;
+}
+
+uint8_t* Image::GetBackLumaRow(size_t row) {
+    return reinterpret_cast<uint8_t*>(back_.data()) + offset_ + row * stride_;
+}
+
+void Image::ToRgb() {
+    if (format_ == EPixelFormat::Rgb) {
+        return;
+    }
+    /* Pixel k of the buffer is written to bytes 3k..3k+2 and its luma is byte k, so walking down from the last
+       pixel never overwrites luma that is still to be read */
+    for (int32_t row = height_ - 1; row >= 0; --row) {
+        const uint8_t* luma = GetLumaRow(row);
+        Pixel* pixels = GetRow(row);
+        for (int32_t pixel = width_ - 1; pixel >= 0; --pixel) {
+            const uint8_t value = luma[pixel];
+            pixels[pixel] = Pixel{value, value, value};
+        }
+    }
+    format_ = EPixelFormat::Rgb;
+}
+
 Pixel Image::GetPixel(size_t row, size_t pixel) {
-    return image_[row][pixel];
+    return GetRow(row)[pixel];
 }
 void Image::SetPixelFl(size_t& row, size_t& pixel, float& r, float& g, float& b) {
-    image_[row][pixel].SetColorFl(r, g, b);
+    GetRow(row)[pixel].SetColorFl(r, g, b);
 }
 
 void Image::SetPixel(size_t& row, size_t& pixel, uint8_t& r, uint8_t& g, uint8_t& b) {
-    image_[row][pixel].SetColor(r, g, b);
+    GetRow(row)[pixel].SetColor(r, g, b);
 }
 
 void Image::SetPixel32(size_t& row, size_t& pixel, int32_t& r, int32_t& g, int32_t& b) {
-    image_[row][pixel].SetColor32(r, g, b);
+    GetRow(row)[pixel].SetColor32(r, g, b);
+}
+
+void ClampCropRect(int32_t image_width, int32_t image_height, int32_t& x, int32_t& y, int32_t& width, int32_t& height) {
+    x = std::max(0, std::min(x, image_width - 1));
+    y = std::max(0, std::min(y, image_height - 1));
+    width = width > 0 ? std::min(width, image_width - x) : image_width - x;
+    height = height > 0 ? std::min(height, image_height - y) : image_height - y;
 }
 
 void Image::Crop(int32_t& width, int32_t& height) {
-    if (width <= width_ && width > 0) {
-        width_ = width;
-        info_header_.width = width;
-    }
-    if (height <= height_ && height > 0) {
-        height_ = height;
-        info_header_.height = height;
-    }
+    Crop(0, 0, width, height);
+}
 
-    offset_ = (PIXELS_ALIGNMENT - width_ * static_cast<int32_t>(PIXEL_SIZE) % PIXELS_ALIGNMENT) % PIXELS_ALIGNMENT;
-    file_header_.Size = sizeof(TFileHeader) + sizeof(TInfoHeader) + width_ * height_ * PIXEL_SIZE;
-    std::reverse(image_.begin(), image_.end());
-    image_.resize(height_);
-    std::reverse(image_.begin(), image_.end());
+void Image::Crop(int32_t x, int32_t y, int32_t width, int32_t height) {
+    ClampCropRect(width_, height_, x, y, width, height);
+    /* Rows are stored bottom-up, so the top rows of the view are the last ones of the old view */
+    offset_ += static_cast<size_t>(height_ - y - height) * stride_ + static_cast<size_t>(x);
+    width_ = width;
+    height_ = height;
 }
 
 void Pixel::SetColorFl(float& r, float& g, float& b) {
@@ -70,217 +249,38 @@ void Pixel::SetColor32(int32_t& r, int32_t& g, int32_t& b) {
 }
 
 void Image::Read(const std::string& input_path) {
-
-    std::ifstream input(input_path, std::ios_base::binary);
-
-    if (!input.is_open()) {
-        throw(std::runtime_error("Failed to open " + input_path));
-    }
-
-    char header_read[sizeof(TFileHeader)];
-    input.read(header_read, sizeof(TFileHeader));
-
-    if (header_read[0] != 'B' || header_read[1] != 'M') {
-        throw(std::runtime_error("The specified path is not a bitmap image.\n"));
-    }
-
-    TFileHeader* file_header_ptr = reinterpret_cast<TFileHeader*>(header_read);
-    if (file_header_ptr == nullptr) {
-        throw(std::runtime_error("Failed to cast\n"));
-    }
-    file_header_ = *file_header_ptr;
-
-    char info_read[sizeof(TInfoHeader)];
-    input.read(info_read, sizeof(TInfoHeader));
-    TInfoHeader* file_info_ptr = reinterpret_cast<TInfoHeader*>(info_read);
-    if (file_info_ptr == nullptr) {
-        throw(std::runtime_error("Failed to cast\n"));
-    }
-    info_header_ = *file_info_ptr;
-
-    width_ = info_header_.width;
-    height_ = info_header_.height;
-    offset_ = (PIXELS_ALIGNMENT - width_ * static_cast<int32_t>(PIXEL_SIZE) % PIXELS_ALIGNMENT) % PIXELS_ALIGNMENT;
-    image_.resize(height_, std::vector<Pixel>(width_));
-
-    for (size_t row = 0; row < height_; ++row) {
-        for (size_t pixel = 0; pixel < width_; ++pixel) {
-            char colors[PIXEL_SIZE];
-            input.read(colors, PIXEL_SIZE);
-            image_[row][pixel].R = static_cast<uint8_t>(colors[2]);
-            image_[row][pixel].G = static_cast<uint8_t>(colors[1]);
-            image_[row][pixel].B = static_cast<uint8_t>(colors[0]);
-        }
-        input.ignore(offset_);
-    }
-    input.close();
+    BmpReader reader(input_path);
+    Read(reader, 0, 0, 0, 0);
 }
 
-void Image::Write(const std::string& output_path) {
-
-    std::ofstream output(output_path, std::ios::binary);
-
-    if (!output.is_open()) {
-        throw(std::runtime_error("Failed to create " + output_path));
-    }
-
-    char* output_header_ptr = reinterpret_cast<char*>(&file_header_);
-
-    if (output_header_ptr == nullptr) {
-        throw(std::runtime_error("Failed to cast\n"));
-    }
-
-    output.write(output_header_ptr, sizeof(TFileHeader));
-
-    char* output_info_ptr = reinterpret_cast<char*>(&info_header_);
-
-    if (output_info_ptr == nullptr) {
-        throw(std::runtime_error("Failed to cast\n"));
-    }
-
-    output.write(output_info_ptr, sizeof(TInfoHeader));
-
-    for (size_t row = 0; row < height_; ++row) {
-        for (size_t pixel = 0; pixel < width_; ++pixel) {
-            uint8_t red_channel = image_[row][pixel].R;
-            uint8_t green_channel = image_[row][pixel].G;
-            uint8_t blue_channel = image_[row][pixel].B;
-            uint8_t color[] = {blue_channel, green_channel, red_channel};
-            char* rgb_ptr = reinterpret_cast<char*>(color);
-            if (rgb_ptr == nullptr) {
-                throw(std::runtime_error("Failed to cast\n"));
-            }
-            output.write(rgb_ptr, PIXEL_SIZE);
-        }
-        output.write(reinterpret_cast<char*>(pad_), offset_);
-    }
-    output.close();
+void Image::Read(BmpReader& reader, int32_t x, int32_t y, int32_t width, int32_t height) {
+    ClampCropRect(reader.GetWidth(), reader.GetHeight(), x, y, width, height);
+    info_header_ = reader.GetInfoHeader();
+    Resize(width, height);
+    /* The top rows of the image are the last ones in the file */
+    reader.ReadRows(reader.GetHeight() - y - height, height, x, width, GetRow(0), stride_);
 }
 
-int main(int argc, char** argv) {
-
-    if (argc < 3) {
-        std::cerr << "not enough arguments\n";
-        return 2;
-    }
-
-    std::string input_file = argv[1];
-    std::string output_file = argv[2];
-    std::vector<TParams> arguments;
-
-    for (int i = 3; i < argc; ++i) {
-        std::string filter = argv[i];
-        if (filter == "-crop") {
-            if (i + 2 >= argc) {
-                std::cerr << "not enough arguments for -crop\n";
-                return 2;
-            }
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Crop,
-                .Param1 = std::stoi(argv[i + 1]),
-                .Param2 = std::stoi(argv[i + 2]),
-            });
-        } else if (filter == "-gs") {
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Grayscale,
-            });
-        } else if (filter == "-sepia") {
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Sepia,
-            });
-        } else if (filter == "-neg") {
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Negative,
-            });
-        } else if (filter == "-sharp") {
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Sharpening,
-            });
-        } else if (filter == "-edge") {
-            if (i + 1 >= argc) {
-                std::cerr << "not enough arguments for -edge\n";
-                return 2;
-            }
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::EdgeDetection,
-                .Param3 = std::stof(argv[i + 1]),
-            });
-        } else if (filter == "-blur") {
-            if (i + 1 >= argc) {
-                std::cerr << "not enough arguments for -blur\n";
-                return 2;
-            }
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::GaussianBlur,
-                .Param3 = std::stof(argv[i + 1]),
-            });
-        } else if (filter == "-cr") {
-            if (i + 1 >= argc) {
-                std::cerr << "not enough arguments for -cr\n";
-                return 2;
-            }
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Contrast,
-                .Param3 = std::stof(argv[i + 1]),
-            });
-        } else if (filter == "-vintage") {
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Contrast,
-                .Param3 = VINTAGECOEF,
-            });
-            arguments.emplace_back(TParams{
-                .Filter = EFilterType::Sepia,
-            });
-        }
-    }
-
-    Image curr_image;
+void Image::Decode(const uint8_t* data, size_t size) {
+    BmpReader reader(data, size);
+    Read(reader, 0, 0, 0, 0);
+}
 
-    try {
-        curr_image.Read(input_file);
-    } catch (std::runtime_error& e) {
-        std::cerr << e.what();
-        return 2;
-    }
+void Image::Write(const std::string& output_path) const {
+    BmpWriter writer(output_path, width_, height_, info_header_);
+    Write(writer);
+}
 
-    for (auto filter : arguments) {
-        if (filter.Filter == EFilterType::Crop) {
-            curr_image.Crop(filter.Param1, filter.Param2);
-        } else if (filter.Filter == EFilterType::Grayscale) {
-            GrayscaleFilter grayscale;
-            grayscale.Process(curr_image);
-        } else if (filter.Filter == EFilterType::Sepia) {
-            GrayscaleFilter grayscale;
-            grayscale.Process(curr_image);
-            SepiaFilter sepia;
-            sepia.Process(curr_image);
-        } else if (filter.Filter == EFilterType::Negative) {
-            NegativeFilter negative;
-            negative.Process(curr_image);
-        } else if (filter.Filter == EFilterType::Sharpening) {
-            SharpeningFilter sharpening;
-            sharpening.Process(curr_image);
-        } else if (filter.Filter == EFilterType::EdgeDetection) {
-            EdgeDetectionFilter edge_detection;
-            edge_detection.SetThreshold(filter.Param3);
-            edge_detection.Process(curr_image);
-        } else if (filter.Filter == EFilterType::GaussianBlur) {
-            GaussianBlurFilter gaussian_blur;
-            gaussian_blur.SetSigma(filter.Param3);
-            gaussian_blur.Process(curr_image);
-        } else if (filter.Filter == EFilterType::Contrast) {
-            ContrastFilter contrast;
-            contrast.SetCoef(filter.Param3);
-            contrast.Process(curr_image);
-        }
-    }
+void Image::Encode(std::vector<uint8_t>& output) const {
+    BmpWriter writer(output, width_, height_, info_header_);
+    Write(writer);
+}
 
-    try {
-        curr_image.Write(output_file);
-    } catch (std::runtime_error& e) {
-        std::cerr << e.what();
-        return 2;
+void Image::Write(BmpWriter& writer) const {
+    if (format_ == EPixelFormat::Luma) {
+        writer.WriteLumaRows(GetLumaRow(0), height_, stride_);
+    } else {
+        writer.WriteRows(GetRow(0), height_, stride_);
     }
-
-    return 0;
+    writer.Finish();
 }
@@ -5,12 +5,18 @@
 #include <fstream>
 #include <stdexcept>
 #include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
 
 const int32_t PIXELS_ALIGNMENT = 4;
 const int32_t PIXEL_SIZE = 3;
 const float BYTEMAXIMUMVALUEFL = 255;
 const uint8_t BYTEMAXIMUMVALUE = 255;
 const float VINTAGECOEF = 1.2;
+const size_t BUFFER_ALIGNMENT = 64;
+const size_t STRIDE_ALIGNMENT = 64; /* Row stride in pixels is a multiple of this, so rows start on BUFFER_ALIGNMENT */
 
 struct Pixel {
     uint8_t R;
@@ -22,6 +28,54 @@ struct Pixel {
     void SetColor32(int32_t& r, int32_t& g, int32_t& b);
 };
 
+/* Accounting of every buffer allocated through AlignedAllocator, reported by --mem-stats */
+struct TBufferStats {
+    size_t Allocations;
+    size_t AllocatedBytes;
+    size_t LiveBytes;
+    size_t PeakLiveBytes; /* Since the last ResetBufferPeak */
+};
+
+void CountBufferAllocation(size_t bytes);
+void CountBufferRelease(size_t bytes);
+TBufferStats GetBufferStats();
+void ResetBufferPeak();
+
+template <typename T, size_t Alignment>
+class AlignedAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {
+    }
+
+    T* allocate(size_t n) {
+        T* ptr = static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+        CountBufferAllocation(n * sizeof(T));
+        return ptr;
+    }
+    void deallocate(T* ptr, size_t n) {
+        CountBufferRelease(n * sizeof(T));
+        ::operator delete(ptr, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+};
+
+template <typename T>
+using AlignedBuffer = std::vector<T, AlignedAllocator<T, BUFFER_ALIGNMENT>>;
+using PixelBuffer = AlignedBuffer<Pixel>;
+
 enum class EFilterType {
     Crop,
     Grayscale,
@@ -33,13 +87,25 @@ enum class EFilterType {
     GaussianBlur,
 };
 
+/* Layout of the pixel data of an Image */
+enum class EPixelFormat {
+    Rgb,
+    Luma, /* All three channels equal, stored as one byte per pixel */
+};
+
 struct TParams {
     EFilterType Filter;
     int32_t Param1;
     int32_t Param2;
     float Param3;
+    int32_t Param4; /* Crop origin, counted from the top-left corner */
+    int32_t Param5;
 };
 
+/* Fits a crop rectangle with its origin counted from the top-left corner into an image_width x image_height image.
+   The origin is clamped into the image, a non-positive or too large size extends the rectangle to the image edge. */
+void ClampCropRect(int32_t image_width, int32_t image_height, int32_t& x, int32_t& y, int32_t& width, int32_t& height);
+
 #pragma pack(push, 1)
 
 struct TFileHeader {
@@ -65,26 +131,75 @@ struct TInfoHeader {
 
 #pragma pack(pop)
 
+class BmpReader;
+class BmpWriter;
+
 class Image {
 public:
     Image();
+    /* Copies own their pixels, Share gives a copy-on-write view instead */
+    Image(const Image& other);
+    Image& operator=(const Image& other);
+    Image(Image&& other) = default;
+    Image& operator=(Image&& other) = default;
 
     void Read(const std::string& input_path);
-    void Write(const std::string& output_path);
+    /* Decodes only the rectangle of the file (see ClampCropRect), the rest of the pixels is never touched */
+    void Read(BmpReader& reader, int32_t x, int32_t y, int32_t width, int32_t height);
+    /* Decodes a BMP file held in memory by the caller, the image keeps no reference to `data` */
+    void Decode(const uint8_t* data, size_t size);
+    void Write(const std::string& output_path) const;
+    /* Encodes the image as a BMP file into `output`, replacing its contents */
+    void Encode(std::vector<uint8_t>& output) const;
+    /* Emits all rows into a writer created for this image's size and finishes it */
+    void Write(BmpWriter& writer) const;
     int32_t GetHeight() const;
     int32_t GetWidth() const;
+    size_t GetStride() const;
+    void Resize(int32_t width, int32_t height);
+    Pixel* GetRow(size_t row);
+    const Pixel* GetRow(size_t row) const;
+    std::span<Pixel> GetRowSpan(size_t row);
+    std::span<const Pixel> GetRowSpan(size_t row) const;
+    /* Filters that cannot work in place write into a back buffer of the same shape and then swap it to the front.
+       The back buffer stays with the image, so a chain of such filters allocates it only once. */
+    void PrepareBackBuffer();
+    Pixel* GetBackRow(size_t row);
+    void SwapBuffers();
+    /* An image sharing this one's pixel buffer until either of them is written. Filters writing the front buffer in
+       place must be preceded by Detach, filters writing into the back buffer need nothing: SwapBuffers leaves the
+       shared buffer to the other images. Both images count as sharing from then on, even after the others are
+       gone: a reference count read without synchronisation says nothing about whether their reads finished. */
+    Image Share();
+    /* Gives the image a pixel buffer of its own if it shares one, copying only the rows of the view */
+    void Detach();
+    /* Luma images keep one byte per pixel in the first third of the same buffers, luma row i starts at byte
+       offset_ + i * stride_. Filters that understand luma read and write these rows, everything else calls
+       ToRgb first, which expands the plane in place. */
+    EPixelFormat GetFormat() const;
+    void SetFormat(EPixelFormat format);
+    uint8_t* GetLumaRow(size_t row);
+    const uint8_t* GetLumaRow(size_t row) const;
+    uint8_t* GetBackLumaRow(size_t row);
+    void ToRgb();
     Pixel GetPixel(size_t row, size_t pixel);
     void SetPixelFl(size_t& row, size_t& pixel, float& r, float& g, float& b);
     void SetPixel(size_t& row, size_t& pixel, uint8_t& r, uint8_t& g, uint8_t& b);
     void SetPixel32(size_t& row, size_t& pixel, int32_t& r, int32_t& g, int32_t& b);
     void Crop(int32_t& width, int32_t& height);
+    /* Narrows the image to a view of the rectangle without moving pixels, see ClampCropRect */
+    void Crop(int32_t x, int32_t y, int32_t width, int32_t height);
 
 private:
-    int32_t width_;
-    int32_t height_;
-    int32_t offset_;
-    TFileHeader file_header_;
-    TInfoHeader info_header_;
-    uint8_t pad_[3] = {0, 0, 0};
-    std::vector<std::vector<Pixel>> image_;
+    int32_t width_ = 0;
+    int32_t height_ = 0;
+    size_t stride_ = 0;
+    size_t offset_ = 0; /* Position of the first pixel of the view in the buffers, crops only move this */
+    EPixelFormat format_ = EPixelFormat::Rgb;
+    TInfoHeader info_header_{}; /* Header of the source file, its resolution fields are carried over on Write */
+    /* Rows bottom-up as in the file, row i starts at (*image_)[offset_ + i * stride_]. Shared between the images
+       returned by Share, the back buffer is always private. */
+    std::shared_ptr<PixelBuffer> image_ = std::make_shared<PixelBuffer>();
+    bool shared_ = false; /* Set by Share, the front buffer is not written in place until it is replaced */
+    PixelBuffer back_;
 };
@@ -0,0 +1,219 @@
+#include "pipeline.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <sstream>
+#include <unistd.h>
+
+/* Every allocation of the process goes through these, so each measured run reports what it allocated */
+static std::atomic<size_t> allocation_count = 0;
+static std::atomic<size_t> allocated_bytes = 0;
+
+static void* CountedAllocate(size_t size, std::align_val_t alignment) {
+    ++allocation_count;
+    allocated_bytes += size;
+    const size_t align = std::max(static_cast<size_t>(alignment), sizeof(void*));
+    void* ptr = std::aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size) {
+    return CountedAllocate(size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+void* operator new[](size_t size) {
+    return CountedAllocate(size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    return CountedAllocate(size, alignment);
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return CountedAllocate(size, alignment);
+}
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+struct TBenchResult {
+    double Seconds;
+    size_t Allocations;
+    size_t AllocatedBytes;
+};
+
+/* Runs `prepare` untimed and `body` timed `repeat` times, keeping the fastest run */
+template <typename Prepare, typename Body>
+static TBenchResult Measure(int32_t repeat, Prepare prepare, Body body) {
+    TBenchResult best{1e100, 0, 0};
+    for (int32_t run = 0; run < repeat; ++run) {
+        prepare();
+        const size_t allocations_before = allocation_count;
+        const size_t bytes_before = allocated_bytes;
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds < best.Seconds) {
+            best = {seconds, allocation_count - allocations_before, allocated_bytes - bytes_before};
+        }
+    }
+    return best;
+}
+
+static void PrintResult(double megapixels, const std::string& stage, size_t bytes, const TBenchResult& result) {
+    std::printf("%8.1f  %-22s %10.2f %10.1f %10.1f %8zu %10.1f\n", megapixels, stage.c_str(), result.Seconds * 1e3,
+                megapixels / result.Seconds, static_cast<double>(bytes) / result.Seconds / 1e6, result.Allocations,
+                static_cast<double>(result.AllocatedBytes) / 1e6);
+    std::fflush(stdout);
+}
+
+static Image MakeSyntheticImage(int32_t width, int32_t height) {
+    Image image;
+    image.Resize(width, height);
+    uint32_t state = 0x9E3779B9;
+    for (int32_t row = 0; row < height; ++row) {
+        Pixel* pixels = image.GetRow(row);
+        for (int32_t pixel = 0; pixel < width; ++pixel) {
+            /* A smooth gradient with some noise, so thresholds and clamps take both branches */
+            state = state * 1664525 + 1013904223;
+            const uint8_t noise = static_cast<uint8_t>(state >> 27);
+            pixels[pixel] = Pixel{static_cast<uint8_t>(pixel + noise), static_cast<uint8_t>(row + noise),
+                                  static_cast<uint8_t>((pixel ^ row) + noise)};
+        }
+    }
+    return image;
+}
+
+struct TBenchFilter {
+    std::string Name;
+    std::vector<TParams> Arguments;
+};
+
+static std::vector<TBenchFilter> GetBenchFilters() {
+    return {
+        {"crop", {TParams{.Filter = EFilterType::Crop, .Param1 = 800, .Param2 = 600}}},
+        {"grayscale", {TParams{.Filter = EFilterType::Grayscale}}},
+        {"sepia", {TParams{.Filter = EFilterType::Sepia}}},
+        {"negative", {TParams{.Filter = EFilterType::Negative}}},
+        {"contrast", {TParams{.Filter = EFilterType::Contrast, .Param3 = 1.1}}},
+        {"vintage -neg -cr", {TParams{.Filter = EFilterType::Contrast, .Param3 = VINTAGECOEF},
+                              TParams{.Filter = EFilterType::Sepia}, TParams{.Filter = EFilterType::Negative},
+                              TParams{.Filter = EFilterType::Contrast, .Param3 = 1.1}}},
+        {"sharpening", {TParams{.Filter = EFilterType::Sharpening}}},
+        {"edge detection", {TParams{.Filter = EFilterType::EdgeDetection, .Param3 = 0.1}}},
+        {"gaussian blur 2", {TParams{.Filter = EFilterType::GaussianBlur, .Param3 = 2}}},
+        {"gaussian blur 8", {TParams{.Filter = EFilterType::GaussianBlur, .Param3 = 8}}},
+    };
+}
+
+static std::vector<double> ParseSizes(const std::string& list) {
+    std::vector<double> sizes;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        sizes.emplace_back(std::stod(item));
+    }
+    return sizes;
+}
+
+int main(int argc, char** argv) {
+    std::vector<double> sizes = {1, 10, 50, 200};
+    int32_t repeat = 3;
+    std::string filter_name;
+    std::filesystem::path directory = std::filesystem::temp_directory_path();
+
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "not enough arguments for " << option << "\n";
+            return 2;
+        }
+        if (option == "--sizes") {
+            sizes = ParseSizes(argv[++i]);
+        } else if (option == "--repeat") {
+            repeat = std::max(1, std::stoi(argv[++i]));
+        } else if (option == "--filter") {
+            filter_name = argv[++i];
+        } else if (option == "--threads") {
+            SetThreadCount(static_cast<size_t>(std::max(1, std::stoi(argv[++i]))));
+        } else if (option == "--dir") {
+            directory = argv[++i];
+        } else {
+            std::cerr << "usage: image_processor_bench [--sizes 1,10,50,200] [--repeat 3] [--filter name] "
+                         "[--threads N] [--dir /tmp]\n";
+            return 2;
+        }
+    }
+
+    const std::string path = (directory / ("image_processor_bench_" + std::to_string(getpid()) + ".bmp")).string();
+    std::printf("threads: %zu, luma kernel: %s\n", GetThreadPool().GetConcurrency(), GetLumaRowKernelName());
+    std::printf("%8s  %-22s %10s %10s %10s %8s %10s\n", "MP", "stage", "ms", "MP/s", "MB/s", "allocs", "alloc MB");
+
+    try {
+        for (double megapixels : sizes) {
+            /* 4:3 images, the width is chosen so rows need padding in the file */
+            int32_t height = std::max(1, static_cast<int32_t>(std::sqrt(megapixels * 1e6 * 3 / 4)));
+            int32_t width = std::max(1, static_cast<int32_t>(megapixels * 1e6 / height)) | 1;
+            const double actual_megapixels = static_cast<double>(width) * height / 1e6;
+            const size_t pixel_bytes = static_cast<size_t>(width) * height * PIXEL_SIZE;
+
+            const Image source = MakeSyntheticImage(width, height);
+            Image image;
+
+            if (filter_name.empty() || filter_name == "write") {
+                image = source;
+                PrintResult(actual_megapixels, "write", pixel_bytes,
+                            Measure(repeat, [] {}, [&] { image.Write(path); }));
+            }
+            if (filter_name.empty() || filter_name == "read") {
+                source.Write(path);
+                PrintResult(actual_megapixels, "read", pixel_bytes,
+                            Measure(repeat, [] {}, [&] { image.Read(path); }));
+            }
+            for (const TBenchFilter& filter : GetBenchFilters()) {
+                if (!filter_name.empty() && filter_name != filter.Name) {
+                    continue;
+                }
+                FilterChain chain = BuildPipeline(filter.Arguments);
+                PrintResult(actual_megapixels, filter.Name, pixel_bytes,
+                            Measure(
+                                repeat, [&] { image = source; },
+                                [&] {
+                                    for (auto& stage : chain) {
+                                        stage->Process(image);
+                                    }
+                                }));
+            }
+        }
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what();
+        std::filesystem::remove(path);
+        return 2;
+    }
+    std::filesystem::remove(path);
+    return 0;
+}
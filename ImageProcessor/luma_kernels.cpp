@@ -0,0 +1,192 @@
+#include "luma_kernels.h"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+/* GCC 12 reports the _mm512_undefined_* placeholders inside its own intrinsics as uninitialized once they are
+   inlined at -O2 and above */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#define IMAGE_PROCESSOR_X86 1
+#endif
+
+void LumaRowScalar(const Pixel* source, uint8_t* destination, size_t count, const LumaCoefficients& coefficients,
+                   float offset) {
+    for (size_t pixel = 0; pixel < count; ++pixel) {
+        float value = coefficients[0] * static_cast<float>(source[pixel].R) +
+                      coefficients[1] * static_cast<float>(source[pixel].G) +
+                      coefficients[2] * static_cast<float>(source[pixel].B) + offset;
+        value = std::max(static_cast<float>(0), std::min(value, BYTEMAXIMUMVALUEFL));
+        destination[pixel] = static_cast<uint8_t>(value);
+    }
+}
+
+#ifdef IMAGE_PROCESSOR_X86
+
+/* Every kernel converts 4 interleaved pixels per 128-bit lane into three vectors v0 = {R0 G0 B0 R1},
+   v1 = {G1 B1 R2 G2}, v2 = {B2 R3 G3 B3}, multiplies them by the matching rotation of the coefficients and
+   regroups the products per channel with shuffles, so the sums happen in the same order as in the scalar code. */
+#define LUMA_SHUFFLE(a, b, c, d) _MM_SHUFFLE(d, c, b, a)
+
+static inline __m128 LumaFromProducts(__m128 p0, __m128 p1, __m128 p2, __m128 offset) {
+    __m128 red = _mm_shuffle_ps(p0, _mm_shuffle_ps(p1, p2, LUMA_SHUFFLE(2, 2, 1, 1)), LUMA_SHUFFLE(0, 3, 0, 2));
+    __m128 green = _mm_shuffle_ps(_mm_shuffle_ps(p0, p1, LUMA_SHUFFLE(1, 1, 0, 0)),
+                                  _mm_shuffle_ps(p1, p2, LUMA_SHUFFLE(3, 3, 2, 2)), LUMA_SHUFFLE(0, 2, 0, 2));
+    __m128 blue = _mm_shuffle_ps(_mm_shuffle_ps(p0, p1, LUMA_SHUFFLE(2, 2, 1, 1)), p2, LUMA_SHUFFLE(0, 2, 0, 3));
+    __m128 value = _mm_add_ps(_mm_add_ps(_mm_add_ps(red, green), blue), offset);
+    return _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(value, _mm_set1_ps(BYTEMAXIMUMVALUEFL)));
+}
+
+static void LumaRowSse2(const Pixel* source, uint8_t* destination, size_t count, const LumaCoefficients& coefficients,
+                        float offset) {
+    const __m128 c0 = _mm_setr_ps(coefficients[0], coefficients[1], coefficients[2], coefficients[0]);
+    const __m128 c1 = _mm_setr_ps(coefficients[1], coefficients[2], coefficients[0], coefficients[1]);
+    const __m128 c2 = _mm_setr_ps(coefficients[2], coefficients[0], coefficients[1], coefficients[2]);
+    const __m128 offsets = _mm_set1_ps(offset);
+    const __m128i zero = _mm_setzero_si128();
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(source);
+
+    size_t pixel = 0;
+    for (; pixel + 4 <= count; pixel += 4) {
+        uint8_t chunk[16] = {};
+        std::memcpy(chunk, bytes + pixel * PIXEL_SIZE, 4 * PIXEL_SIZE);
+        __m128i words = _mm_unpacklo_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk)), zero);
+        __m128i high_words = _mm_unpackhi_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk)), zero);
+        __m128 v0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+        __m128 v1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero));
+        __m128 v2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(high_words, zero));
+        __m128i luma = _mm_cvttps_epi32(
+            LumaFromProducts(_mm_mul_ps(v0, c0), _mm_mul_ps(v1, c1), _mm_mul_ps(v2, c2), offsets));
+        luma = _mm_packus_epi16(_mm_packs_epi32(luma, zero), zero);
+        int32_t packed = _mm_cvtsi128_si32(luma);
+        std::memcpy(destination + pixel, &packed, 4);
+    }
+    LumaRowScalar(source + pixel, destination + pixel, count - pixel, coefficients, offset);
+}
+
+__attribute__((target("avx2"))) static void LumaRowAvx2(const Pixel* source, uint8_t* destination, size_t count,
+                                                        const LumaCoefficients& coefficients, float offset) {
+    const __m256 c0 = _mm256_setr_ps(coefficients[0], coefficients[1], coefficients[2], coefficients[0],
+                                     coefficients[0], coefficients[1], coefficients[2], coefficients[0]);
+    const __m256 c1 = _mm256_setr_ps(coefficients[1], coefficients[2], coefficients[0], coefficients[1],
+                                     coefficients[1], coefficients[2], coefficients[0], coefficients[1]);
+    const __m256 c2 = _mm256_setr_ps(coefficients[2], coefficients[0], coefficients[1], coefficients[2],
+                                     coefficients[2], coefficients[0], coefficients[1], coefficients[2]);
+    const __m256 offsets = _mm256_set1_ps(offset);
+    const __m256 maximum = _mm256_set1_ps(BYTEMAXIMUMVALUEFL);
+    /* 8 pixels are 6 dwords d0..d5, pixels 0-3 live in d0-d2 and pixels 4-7 in d3-d5 */
+    const __m256i load_mask = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+    const __m256i regroup = _mm256_setr_epi32(0, 3, 1, 4, 2, 5, 0, 0);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(source);
+
+    size_t pixel = 0;
+    for (; pixel + 8 <= count; pixel += 8) {
+        __m256i dwords =
+            _mm256_maskload_epi32(reinterpret_cast<const int*>(bytes + pixel * PIXEL_SIZE), load_mask);
+        dwords = _mm256_permutevar8x32_epi32(dwords, regroup);
+        __m128i low = _mm256_castsi256_si128(dwords);
+        __m256 v0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(low));
+        __m256 v1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+        __m256 v2 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm256_extracti128_si256(dwords, 1)));
+        __m256 p0 = _mm256_mul_ps(v0, c0);
+        __m256 p1 = _mm256_mul_ps(v1, c1);
+        __m256 p2 = _mm256_mul_ps(v2, c2);
+        __m256 red =
+            _mm256_shuffle_ps(p0, _mm256_shuffle_ps(p1, p2, LUMA_SHUFFLE(2, 2, 1, 1)), LUMA_SHUFFLE(0, 3, 0, 2));
+        __m256 green = _mm256_shuffle_ps(_mm256_shuffle_ps(p0, p1, LUMA_SHUFFLE(1, 1, 0, 0)),
+                                         _mm256_shuffle_ps(p1, p2, LUMA_SHUFFLE(3, 3, 2, 2)), LUMA_SHUFFLE(0, 2, 0, 2));
+        __m256 blue =
+            _mm256_shuffle_ps(_mm256_shuffle_ps(p0, p1, LUMA_SHUFFLE(2, 2, 1, 1)), p2, LUMA_SHUFFLE(0, 2, 0, 3));
+        __m256 value = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(red, green), blue), offsets);
+        value = _mm256_max_ps(_mm256_setzero_ps(), _mm256_min_ps(value, maximum));
+        __m256i luma = _mm256_cvttps_epi32(value);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(luma), _mm256_extracti128_si256(luma, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(destination + pixel), _mm_packus_epi16(words, words));
+    }
+    LumaRowScalar(source + pixel, destination + pixel, count - pixel, coefficients, offset);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void LumaRowAvx512(const Pixel* source, uint8_t* destination,
+                                                                      size_t count,
+                                                                      const LumaCoefficients& coefficients,
+                                                                      float offset) {
+    const __m512 c0 = _mm512_broadcast_f32x4(
+        _mm_setr_ps(coefficients[0], coefficients[1], coefficients[2], coefficients[0]));
+    const __m512 c1 = _mm512_broadcast_f32x4(
+        _mm_setr_ps(coefficients[1], coefficients[2], coefficients[0], coefficients[1]));
+    const __m512 c2 = _mm512_broadcast_f32x4(
+        _mm_setr_ps(coefficients[2], coefficients[0], coefficients[1], coefficients[2]));
+    const __m512 offsets = _mm512_set1_ps(offset);
+    const __m512 maximum = _mm512_set1_ps(BYTEMAXIMUMVALUEFL);
+    /* 16 pixels are 12 dwords, every group of 3 dwords holds 4 pixels */
+    const __m512i regroup = _mm512_setr_epi32(0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, 0, 0, 0, 0);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(source);
+
+    size_t pixel = 0;
+    for (; pixel + 16 <= count; pixel += 16) {
+        __m512i dwords = _mm512_maskz_loadu_epi32(0x0FFF, bytes + pixel * PIXEL_SIZE);
+        dwords = _mm512_permutexvar_epi32(regroup, dwords);
+        __m512 v0 = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm512_castsi512_si128(dwords)));
+        __m512 v1 = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(dwords, 1)));
+        __m512 v2 = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(dwords, 2)));
+        __m512 p0 = _mm512_mul_ps(v0, c0);
+        __m512 p1 = _mm512_mul_ps(v1, c1);
+        __m512 p2 = _mm512_mul_ps(v2, c2);
+        __m512 red =
+            _mm512_shuffle_ps(p0, _mm512_shuffle_ps(p1, p2, LUMA_SHUFFLE(2, 2, 1, 1)), LUMA_SHUFFLE(0, 3, 0, 2));
+        __m512 green = _mm512_shuffle_ps(_mm512_shuffle_ps(p0, p1, LUMA_SHUFFLE(1, 1, 0, 0)),
+                                         _mm512_shuffle_ps(p1, p2, LUMA_SHUFFLE(3, 3, 2, 2)), LUMA_SHUFFLE(0, 2, 0, 2));
+        __m512 blue =
+            _mm512_shuffle_ps(_mm512_shuffle_ps(p0, p1, LUMA_SHUFFLE(2, 2, 1, 1)), p2, LUMA_SHUFFLE(0, 2, 0, 3));
+        __m512 value = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(red, green), blue), offsets);
+        value = _mm512_max_ps(_mm512_setzero_ps(), _mm512_min_ps(value, maximum));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + pixel),
+                         _mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(value)));
+    }
+    LumaRowScalar(source + pixel, destination + pixel, count - pixel, coefficients, offset);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+struct TLumaKernel {
+    LumaRowKernel Kernel;
+    const char* Name;
+};
+
+static TLumaKernel SelectLumaRowKernel() {
+    const char* requested = std::getenv("IMAGE_PROCESSOR_SIMD");
+    std::string limit = requested == nullptr ? "" : requested;
+#ifdef IMAGE_PROCESSOR_X86
+    __builtin_cpu_init();
+    if (limit.empty() || limit == "avx512") {
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+            return {LumaRowAvx512, "avx512"};
+        }
+    }
+    if (limit.empty() || limit == "avx512" || limit == "avx2") {
+        if (__builtin_cpu_supports("avx2")) {
+            return {LumaRowAvx2, "avx2"};
+        }
+    }
+    if (limit != "scalar") {
+        return {LumaRowSse2, "sse2"};
+    }
+#endif
+    return {LumaRowScalar, "scalar"};
+}
+
+static const TLumaKernel& GetLumaKernel() {
+    static const TLumaKernel kernel = SelectLumaRowKernel();
+    return kernel;
+}
+
+LumaRowKernel GetLumaRowKernel() {
+    return GetLumaKernel().Kernel;
+}
+
+const char* GetLumaRowKernelName() {
+    return GetLumaKernel().Name;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "image_processor.h"
+#include <array>
+
+using LumaCoefficients = std::array<float, 3>;
+
+/* Writes clamp(c[0] * R + c[1] * G + c[2] * B + offset) truncated to a byte for each of `count` pixels. All
+   implementations evaluate exactly the same float expression as the scalar reference, so they agree bit for bit. */
+using LumaRowKernel = void (*)(const Pixel* source, uint8_t* destination, size_t count,
+                               const LumaCoefficients& coefficients, float offset);
+
+void LumaRowScalar(const Pixel* source, uint8_t* destination, size_t count, const LumaCoefficients& coefficients,
+                   float offset);
+
+/* Best kernel for the running CPU, chosen once through CPUID. IMAGE_PROCESSOR_SIMD=scalar|sse2|avx2|avx512
+   restricts the choice, which is handy for comparing implementations. */
+LumaRowKernel GetLumaRowKernel();
+const char* GetLumaRowKernelName();
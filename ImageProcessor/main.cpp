@@ -0,0 +1,264 @@
+#include "batch.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "server.h"
+#include "thread_pool.h"
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+/* Reports printed after the run */
+struct TReportOptions {
+    bool Profile = false;
+    bool MemoryStats = false;
+    std::string ProfileJsonPath;
+};
+
+/* Positive integer value of the option at args[i]; moves `i` to the value, or reports the problem and returns
+   false */
+static bool ParseCount(const std::vector<std::string>& args, size_t& i, size_t& count) {
+    const std::string& option = args[i];
+    size_t parsed = 0;
+    unsigned long value = 0;
+    if (i + 1 < args.size() && args[i + 1].find_first_not_of("0123456789") == std::string::npos) {
+        try {
+            value = std::stoul(args[i + 1], &parsed);
+        } catch (std::logic_error&) {
+            parsed = 0;
+        }
+    }
+    if (parsed == 0 || value == 0) {
+        std::cerr << option << " expects a positive number\n";
+        return false;
+    }
+    count = static_cast<size_t>(value);
+    ++i;
+    return true;
+}
+
+/* Filters and options from argv[first] on; reports the problem and returns false on malformed arguments. With
+   `branches`, every "-o <path>" starts a new output whose chain is `arguments` followed by the filters after it. */
+static bool ParseArguments(int argc, char** argv, int first, std::vector<TParams>& arguments,
+                           TReportOptions& reports, std::vector<TOutputBranch>* branches = nullptr) {
+    const std::vector<std::string> args(argv + first, argv + argc);
+    std::vector<TParams>* filters = &arguments;
+    try {
+        for (size_t i = 0; i < args.size(); ++i) {
+            const std::string& option = args[i];
+            if (ParseFilterFlag(args, i, *filters)) {
+                continue;
+            }
+            /* With -o every output is a branch, a positional output path would be silently dropped */
+            if (branches != nullptr && !option.starts_with('-')) {
+                std::cerr << "unexpected argument " << option << ", outputs are given with -o\n";
+                return false;
+            }
+            if (option == "-o") {
+                if (branches == nullptr) {
+                    std::cerr << "-o is only supported with a single input file\n";
+                    return false;
+                }
+                if (i + 1 >= args.size()) {
+                    std::cerr << "not enough arguments for -o\n";
+                    return false;
+                }
+                branches->emplace_back(TOutputBranch{args[++i], arguments});
+                filters = &branches->back().Arguments;
+            } else if (option == "--threads") {
+                size_t threads = 0;
+                if (!ParseCount(args, i, threads)) {
+                    return false;
+                }
+                SetThreadCount(threads);
+            } else if (option == "--profile") {
+                reports.Profile = true;
+                GetProfiler().Enable();
+            } else if (option == "--mem-stats") {
+                reports.MemoryStats = true;
+                GetProfiler().Enable();
+            } else if (option == "--profile-json") {
+                if (i + 1 >= args.size()) {
+                    std::cerr << "not enough arguments for --profile-json\n";
+                    return false;
+                }
+                reports.ProfileJsonPath = args[++i];
+                GetProfiler().Enable();
+            }
+        }
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what();
+        return false;
+    }
+    return true;
+}
+
+/* Emits the requested reports and returns `status`, or 2 if a report could not be written */
+static int Report(int status, const TReportOptions& reports) {
+    try {
+        if (reports.Profile) {
+            GetProfiler().PrintTable(std::cerr);
+        }
+        if (reports.MemoryStats) {
+            GetProfiler().PrintMemoryTable(std::cerr);
+        }
+        if (!reports.ProfileJsonPath.empty()) {
+            GetProfiler().WriteJson(reports.ProfileJsonPath);
+        }
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what();
+        return 2;
+    }
+    return status;
+}
+
+/* --serve <socket> [--threads N] [--workers N] [--queue N] */
+static int RunServer(int argc, char** argv) {
+    TServerOptions options;
+    const std::vector<std::string> args(argv + 3, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string option = args[i];
+        size_t count = 0;
+        if (!ParseCount(args, i, count)) {
+            return 2;
+        }
+        if (option == "--threads") {
+            SetThreadCount(count);
+        } else if (option == "--workers") {
+            options.Workers = count;
+        } else if (option == "--queue") {
+            options.QueueDepth = count;
+        } else {
+            std::cerr << "unknown option " << option << " for --serve\n";
+            return 2;
+        }
+    }
+    try {
+        Serve(argv[2], options);
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what();
+        return 2;
+    }
+    return 0;
+}
+
+/* --connect <socket> <input> <output> [--inline] [filters]: a client of --serve. Paths are sent as absolute
+   paths for the server to read and write, with --inline the client sends and receives the file contents. */
+static int RunClient(int argc, char** argv) {
+    if (argc < 5) {
+        std::cerr << "not enough arguments for --connect\n";
+        return 2;
+    }
+    TServeRequest request;
+    bool is_inline = false;
+    for (int i = 5; i < argc; ++i) {
+        if (std::string(argv[i]) == "--inline") {
+            is_inline = true;
+        } else {
+            request.Filters.emplace_back(argv[i]);
+        }
+    }
+    try {
+        if (is_inline) {
+            std::ifstream input(argv[3], std::ios::binary);
+            if (!input) {
+                throw(std::runtime_error(std::string("Failed to open ") + argv[3] + "\n"));
+            }
+            request.InputData.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        } else {
+            request.InputPath = std::filesystem::absolute(argv[3]).string();
+            request.OutputPath = std::filesystem::absolute(argv[4]).string();
+        }
+        TServeResponse response = SendRequest(argv[2], request);
+        if (!response.Succeeded) {
+            throw(std::runtime_error(response.Error));
+        }
+        if (is_inline) {
+            std::ofstream output(argv[4], std::ios::binary);
+            output.write(reinterpret_cast<const char*>(response.OutputData.data()),
+                         static_cast<std::streamsize>(response.OutputData.size()));
+            if (!output.flush()) {
+                throw(std::runtime_error(std::string("Failed to write ") + argv[4] + "\n"));
+            }
+        }
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what();
+        return 2;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    if (argc < 3) {
+        std::cerr << "not enough arguments\n";
+        return 2;
+    }
+
+    std::vector<TParams> arguments;
+    TReportOptions reports;
+    std::string mode = argv[1];
+
+    if (mode == "--serve") {
+        return RunServer(argc, argv);
+    }
+    if (mode == "--connect") {
+        return RunClient(argc, argv);
+    }
+
+    if (mode == "--batch" || mode == "--glob") {
+        /* --batch <manifest> or --glob <pattern> <output directory>, then the filters */
+        const int first = mode == "--batch" ? 3 : 4;
+        for (int i = 2; i < first; ++i) {
+            if (i >= argc || argv[i][0] == '-') {
+                std::cerr << "not enough arguments for " << mode << "\n";
+                return 2;
+            }
+        }
+        if (!ParseArguments(argc, argv, first, arguments, reports)) {
+            return 2;
+        }
+        size_t depth = BATCH_QUEUE_DEPTH;
+        const std::vector<std::string> args(argv + first, argv + argc);
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--depth" && !ParseCount(args, i, depth)) {
+                return 2;
+            }
+        }
+        try {
+            std::vector<TBatchJob> jobs = mode == "--batch" ? ReadManifest(argv[2]) : GlobJobs(argv[2], argv[3]);
+            return Report(ProcessBatch(jobs, arguments, depth) ? 0 : 2, reports);
+        } catch (std::runtime_error& e) {
+            std::cerr << e.what();
+            return 2;
+        }
+    }
+
+    std::string input_file = argv[1];
+    if (std::find(argv + 2, argv + argc, std::string("-o")) != argv + argc) {
+        std::vector<TOutputBranch> branches;
+        if (!ParseArguments(argc, argv, 2, arguments, reports, &branches)) {
+            return 2;
+        }
+        try {
+            ProcessFanOut(input_file, branches);
+        } catch (std::runtime_error& e) {
+            std::cerr << e.what();
+            return 2;
+        }
+        return Report(0, reports);
+    }
+
+    std::string output_file = argv[2];
+    if (!ParseArguments(argc, argv, 3, arguments, reports)) {
+        return 2;
+    }
+
+    try {
+        ProcessFile(input_file, output_file, arguments);
+    } catch (std::runtime_error& e) {
+        std::cerr << e.what();
+        return 2;
+    }
+
+    return Report(0, reports);
+}
@@ -0,0 +1,547 @@
+#include "pipeline.h"
+#include "bmp_io.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include <sys/stat.h>
+
+bool IsPointFilter(EFilterType filter) {
+    switch (filter) {
+        case EFilterType::Crop:
+        case EFilterType::Grayscale:
+        case EFilterType::Sepia:
+        case EFilterType::Negative:
+        case EFilterType::Contrast:
+            return true;
+        case EFilterType::Sharpening:
+        case EFilterType::EdgeDetection:
+        case EFilterType::GaussianBlur:
+            return false;
+    }
+    return false;
+}
+
+bool CanStream(const std::vector<TParams>& arguments) {
+    return std::all_of(arguments.begin(), arguments.end(),
+                       [](const TParams& params) { return IsPointFilter(params.Filter); });
+}
+
+int32_t GetFilterHalo(const TParams& params) {
+    switch (params.Filter) {
+        case EFilterType::Sharpening:
+        case EFilterType::EdgeDetection:
+            return 1;
+        case EFilterType::GaussianBlur: {
+            GaussianBlurFilter gaussian_blur;
+            float sigma = params.Param3;
+            gaussian_blur.SetSigma(sigma);
+            return gaussian_blur.GetRadius();
+        }
+        default:
+            return 0;
+    }
+}
+
+static bool IsInteger(const std::string& argument) {
+    size_t digits = argument.starts_with('-') ? 1 : 0;
+    return digits < argument.size() && argument.find_first_not_of("0123456789", digits) == std::string::npos;
+}
+
+/* Parameter `index` of the flag at args[flag] */
+static const std::string& GetParameter(const std::vector<std::string>& args, size_t flag, size_t index) {
+    if (flag + index >= args.size()) {
+        throw(std::runtime_error("not enough arguments for " + args[flag] + "\n"));
+    }
+    return args[flag + index];
+}
+
+static int32_t ParseInteger(const std::vector<std::string>& args, size_t flag, size_t index) {
+    const std::string& parameter = GetParameter(args, flag, index);
+    if (IsInteger(parameter)) {
+        try {
+            return std::stoi(parameter);
+        } catch (std::logic_error&) {
+        }
+    }
+    throw(std::runtime_error("invalid parameter " + parameter + " for " + args[flag] + "\n"));
+}
+
+static float ParseFloat(const std::vector<std::string>& args, size_t flag, size_t index) {
+    const std::string& parameter = GetParameter(args, flag, index);
+    size_t parsed = 0;
+    float value = 0;
+    try {
+        value = std::stof(parameter, &parsed);
+    } catch (std::logic_error&) {
+        parsed = 0;
+    }
+    if (parsed != parameter.size()) {
+        throw(std::runtime_error("invalid parameter " + parameter + " for " + args[flag] + "\n"));
+    }
+    return value;
+}
+
+bool ParseFilterFlag(const std::vector<std::string>& args, size_t& i, std::vector<TParams>& arguments) {
+    const std::string& filter = args[i];
+    if (filter == "-crop") {
+        GetParameter(args, i, 2);
+        if (i + 4 < args.size() && IsInteger(args[i + 3]) && IsInteger(args[i + 4])) {
+            arguments.emplace_back(TParams{
+                .Filter = EFilterType::Crop,
+                .Param1 = ParseInteger(args, i, 3),
+                .Param2 = ParseInteger(args, i, 4),
+                .Param4 = ParseInteger(args, i, 1),
+                .Param5 = ParseInteger(args, i, 2),
+            });
+            i += 4;
+            return true;
+        }
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Crop,
+            .Param1 = ParseInteger(args, i, 1),
+            .Param2 = ParseInteger(args, i, 2),
+        });
+        i += 2;
+    } else if (filter == "-gs") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Grayscale,
+        });
+    } else if (filter == "-sepia") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Sepia,
+        });
+    } else if (filter == "-neg") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Negative,
+        });
+    } else if (filter == "-sharp") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Sharpening,
+        });
+    } else if (filter == "-edge") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::EdgeDetection,
+            .Param3 = ParseFloat(args, i, 1),
+        });
+        ++i;
+    } else if (filter == "-blur") {
+        const float sigma = ParseFloat(args, i, 1);
+        if (!std::isfinite(sigma) || sigma > GAUSSIANMAXSIGMA) {
+            throw(std::runtime_error("invalid parameter " + args[i + 1] + " for -blur\n"));
+        }
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::GaussianBlur,
+            .Param3 = sigma,
+        });
+        ++i;
+    } else if (filter == "-cr") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Contrast,
+            .Param3 = ParseFloat(args, i, 1),
+        });
+        ++i;
+    } else if (filter == "-vintage") {
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Contrast,
+            .Param3 = VINTAGECOEF,
+        });
+        arguments.emplace_back(TParams{
+            .Filter = EFilterType::Sepia,
+        });
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::vector<TParams> ParseFilterChain(const std::vector<std::string>& args) {
+    std::vector<TParams> arguments;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (!ParseFilterFlag(args, i, arguments)) {
+            throw(std::runtime_error("unknown filter " + args[i] + "\n"));
+        }
+    }
+    return arguments;
+}
+
+/* Consecutive colour filters are folded into the colour matrix stage at the end of the chain instead of each
+   making its own pass over the image, as long as the folding is exact */
+static void AppendFilter(FilterChain& chain, std::unique_ptr<AbstractFilter> filter) {
+    auto* channel_filter = dynamic_cast<ChannelFilter*>(filter.get());
+    auto* color_filter = dynamic_cast<ColorMatrixFilter*>(filter.get());
+    if (channel_filter == nullptr && color_filter == nullptr) {
+        chain.emplace_back(std::move(filter));
+        return;
+    }
+    auto* stage = chain.empty() ? nullptr : dynamic_cast<ColorMatrixFilter*>(chain.back().get());
+    if (stage == nullptr || (color_filter != nullptr && !stage->Append(*color_filter))) {
+        chain.emplace_back(std::make_unique<ColorMatrixFilter>());
+        stage = static_cast<ColorMatrixFilter*>(chain.back().get());
+        if (color_filter != nullptr) {
+            stage->Append(*color_filter);
+        }
+    }
+    if (channel_filter != nullptr) {
+        stage->Append(*channel_filter);
+    }
+}
+
+FilterChain BuildPipeline(const std::vector<TParams>& arguments) {
+    FilterChain chain;
+    for (TParams filter : arguments) {
+        if (filter.Filter == EFilterType::Crop) {
+            auto crop = std::make_unique<CropFilter>();
+            crop->SetSize(filter.Param1, filter.Param2);
+            crop->SetOrigin(filter.Param4, filter.Param5);
+            AppendFilter(chain, std::move(crop));
+        } else if (filter.Filter == EFilterType::Grayscale) {
+            AppendFilter(chain, std::make_unique<GrayscaleFilter>());
+        } else if (filter.Filter == EFilterType::Sepia) {
+            AppendFilter(chain, std::make_unique<GrayscaleFilter>());
+            AppendFilter(chain, std::make_unique<SepiaFilter>());
+        } else if (filter.Filter == EFilterType::Negative) {
+            AppendFilter(chain, std::make_unique<NegativeFilter>());
+        } else if (filter.Filter == EFilterType::Sharpening) {
+            AppendFilter(chain, std::make_unique<SharpeningFilter>());
+        } else if (filter.Filter == EFilterType::EdgeDetection) {
+            auto edge_detection = std::make_unique<EdgeDetectionFilter>();
+            edge_detection->SetThreshold(filter.Param3);
+            AppendFilter(chain, std::move(edge_detection));
+        } else if (filter.Filter == EFilterType::GaussianBlur) {
+            auto gaussian_blur = std::make_unique<GaussianBlurFilter>();
+            gaussian_blur->SetSigma(filter.Param3);
+            AppendFilter(chain, std::move(gaussian_blur));
+        } else if (filter.Filter == EFilterType::Contrast) {
+            auto contrast = std::make_unique<ContrastFilter>();
+            contrast->SetCoef(filter.Param3);
+            AppendFilter(chain, std::move(contrast));
+        }
+    }
+    return chain;
+}
+
+std::vector<TParams> PushDownCrops(const std::vector<TParams>& arguments, int32_t width, int32_t height, TRect& source) {
+    const size_t count = arguments.size();
+
+    /* Size of the image entering every stage, and the clamped rectangle of every crop */
+    std::vector<TRect> inputs(count + 1);
+    std::vector<TRect> crops(count);
+    inputs[0] = {0, 0, width, height};
+    for (size_t i = 0; i < count; ++i) {
+        inputs[i + 1] = inputs[i];
+        if (arguments[i].Filter == EFilterType::Crop) {
+            TRect& crop = crops[i];
+            crop = {arguments[i].Param4, arguments[i].Param5, arguments[i].Param1, arguments[i].Param2};
+            ClampCropRect(inputs[i].Width, inputs[i].Height, crop.X, crop.Y, crop.Width, crop.Height);
+            inputs[i + 1] = {0, 0, crop.Width, crop.Height};
+        }
+    }
+
+    /* Walking backwards from the whole output, the part of every stage's input that the output depends on. Near the
+       true image edge the halo is clipped, and the replicated border is the same as in the full image. */
+    std::vector<TRect> needed(count + 1);
+    needed[count] = inputs[count];
+    for (size_t i = count; i-- > 0;) {
+        TRect rect = needed[i + 1];
+        if (arguments[i].Filter == EFilterType::Crop) {
+            rect.X += crops[i].X;
+            rect.Y += crops[i].Y;
+        } else {
+            /* Clipped before adding, so a large halo cannot overflow */
+            const int32_t halo = GetFilterHalo(arguments[i]);
+            const int32_t left = rect.X - std::min(rect.X, halo);
+            const int32_t top = rect.Y - std::min(rect.Y, halo);
+            const int32_t right = rect.X + rect.Width + std::min(inputs[i].Width - rect.X - rect.Width, halo);
+            const int32_t bottom = rect.Y + rect.Height + std::min(inputs[i].Height - rect.Y - rect.Height, halo);
+            rect = {left, top, right - left, bottom - top};
+        }
+        needed[i] = rect;
+    }
+    source = needed[0];
+
+    /* After every stage the image holds needed[i] of that stage's input, which is narrowed to needed[i + 1] */
+    std::vector<TParams> plan;
+    for (size_t i = 0; i < count; ++i) {
+        const bool is_crop = arguments[i].Filter == EFilterType::Crop;
+        if (!is_crop) {
+            plan.emplace_back(arguments[i]);
+        }
+        const TRect& next = needed[i + 1];
+        const int32_t x = next.X + (is_crop ? crops[i].X : 0) - needed[i].X;
+        const int32_t y = next.Y + (is_crop ? crops[i].Y : 0) - needed[i].Y;
+        if (x != 0 || y != 0 || next.Width != needed[i].Width || next.Height != needed[i].Height) {
+            plan.emplace_back(TParams{
+                .Filter = EFilterType::Crop,
+                .Param1 = next.Width,
+                .Param2 = next.Height,
+                .Param4 = x,
+                .Param5 = y,
+            });
+        }
+    }
+    return plan;
+}
+
+static bool IsSameFile(const std::string& first_path, const std::string& second_path) {
+    struct stat first;
+    struct stat second;
+    if (stat(first_path.c_str(), &first) != 0 || stat(second_path.c_str(), &second) != 0) {
+        return false;
+    }
+    return first.st_dev == second.st_dev && first.st_ino == second.st_ino;
+}
+
+static size_t GetPixelCount(const Image& image) {
+    return static_cast<size_t>(image.GetWidth()) * static_cast<size_t>(image.GetHeight());
+}
+
+static size_t GetPixelBytes(const Image& image) {
+    return GetPixelCount(image) * (image.GetFormat() == EPixelFormat::Luma ? 1 : sizeof(Pixel));
+}
+
+void RunChain(FilterChain& chain, Image& image) {
+    for (size_t i = 0; i < chain.size(); ++i) {
+        StageTimer timer;
+        const size_t input_bytes = GetPixelBytes(image);
+        const size_t input_pixels = GetPixelCount(image);
+        if (chain[i]->WritesInPlace()) {
+            image.Detach();
+        }
+        chain[i]->Process(image);
+        if (timer.IsEnabled()) {
+            /* Crops only move the view of the image */
+            const bool is_crop = dynamic_cast<CropFilter*>(chain[i].get()) != nullptr;
+            timer.Stop(std::to_string(i + 1) + " " + chain[i]->GetName(),
+                       is_crop ? 0 : input_bytes + GetPixelBytes(image), input_pixels);
+        }
+    }
+}
+
+void ProcessStreaming(const std::string& input_path, const std::string& output_path,
+                      const std::vector<TParams>& arguments, Image& band) {
+    BmpReader reader(input_path);
+
+    /* Crops of a point filter chain need no halo, so they all turn into the rectangle read from the file */
+    TRect source;
+    FilterChain chain = BuildPipeline(PushDownCrops(arguments, reader.GetWidth(), reader.GetHeight(), source));
+    const int32_t width = source.Width;
+    const int32_t height = source.Height;
+
+    const size_t row_bytes = static_cast<size_t>(width) * sizeof(Pixel);
+    const int32_t band_rows = static_cast<int32_t>(
+        std::clamp<size_t>(STREAM_BAND_BYTES / row_bytes, 1, static_cast<size_t>(height)));
+
+    BmpWriter writer(output_path, width, height, reader.GetInfoHeader());
+    /* The top rows of the image are the last ones in the file */
+    const int32_t end_row = reader.GetHeight() - source.Y;
+    for (int32_t row = end_row - height; row < end_row; row += band_rows) {
+        int32_t rows = std::min(band_rows, end_row - row);
+        StageTimer read_timer;
+        band.Resize(width, rows);
+        reader.ReadRows(row, rows, source.X, width, band.GetRow(0), band.GetStride());
+        read_timer.Stop("read", 2 * GetPixelBytes(band), GetPixelCount(band));
+        RunChain(chain, band);
+        StageTimer write_timer;
+        if (band.GetFormat() == EPixelFormat::Luma) {
+            writer.WriteLumaRows(band.GetLumaRow(0), rows, band.GetStride());
+        } else {
+            writer.WriteRows(band.GetRow(0), rows, band.GetStride());
+        }
+        write_timer.Stop("write", 2 * GetPixelBytes(band), GetPixelCount(band));
+    }
+    StageTimer write_timer;
+    writer.Finish();
+    write_timer.Stop("write", 0, 0);
+}
+
+void ProcessFile(const std::string& input_path, const std::string& output_path, const std::vector<TParams>& arguments) {
+    Image image;
+    ProcessFile(input_path, output_path, arguments, image);
+}
+
+/* Decodes the part of the reader's image that reaches the output of the chain and returns the filters turning it
+   into the output. Crops are pushed towards the decoder, which then reads only the rows and columns that reach
+   the output. */
+static FilterChain DecodeNeeded(BmpReader& reader, const std::vector<TParams>& arguments, Image& image,
+                                StageTimer& read_timer) {
+    TRect source;
+    FilterChain chain = BuildPipeline(PushDownCrops(arguments, reader.GetWidth(), reader.GetHeight(), source));
+    image.Read(reader, source.X, source.Y, source.Width, source.Height);
+    read_timer.Stop("read", 2 * GetPixelBytes(image), GetPixelCount(image));
+    return chain;
+}
+
+static void ProcessDecoded(BmpReader& reader, const std::vector<TParams>& arguments, Image& image,
+                           StageTimer& read_timer) {
+    FilterChain chain = DecodeNeeded(reader, arguments, image, read_timer);
+    RunChain(chain, image);
+}
+
+FilterChain DecodeForChain(const std::string& input_path, const std::vector<TParams>& arguments, Image& image) {
+    StageTimer read_timer;
+    BmpReader reader(input_path);
+    return DecodeNeeded(reader, arguments, image, read_timer);
+}
+
+void WriteImage(const Image& image, const std::string& output_path) {
+    StageTimer write_timer;
+    image.Write(output_path);
+    write_timer.Stop("write", 2 * GetPixelBytes(image), GetPixelCount(image));
+}
+
+void ProcessFile(const std::string& input_path, const std::string& output_path, const std::vector<TParams>& arguments,
+                 Image& image) {
+    /* Streaming truncates the output while the input is still being read, so it cannot run in place */
+    if (CanStream(arguments) && !IsSameFile(input_path, output_path)) {
+        ProcessStreaming(input_path, output_path, arguments, image);
+        return;
+    }
+
+    /* The reader is closed before anything is written, so the output may be the input file */
+    FilterChain chain = DecodeForChain(input_path, arguments, image);
+    RunChain(chain, image);
+    WriteImage(image, output_path);
+}
+
+namespace {
+/* Node of the fan-out tree: the filters after the parent node, the outputs written after them and the subtrees
+   that continue from there */
+struct TFanOutNode {
+    std::vector<TParams> Arguments;
+    std::vector<std::string> Outputs;
+    std::vector<std::unique_ptr<TFanOutNode>> Children;
+};
+}  // namespace
+
+static bool IsSameStage(const TParams& first, const TParams& second) {
+    return first.Filter == second.Filter && first.Param1 == second.Param1 && first.Param2 == second.Param2 &&
+           first.Param3 == second.Param3 && first.Param4 == second.Param4 && first.Param5 == second.Param5;
+}
+
+/* Adds a branch to a tree of single stages */
+static void InsertBranch(TFanOutNode& root, const std::vector<TParams>& arguments, const std::string& output_path) {
+    TFanOutNode* node = &root;
+    for (const TParams& stage : arguments) {
+        auto child = std::find_if(node->Children.begin(), node->Children.end(), [&stage](const auto& candidate) {
+            return IsSameStage(candidate->Arguments[0], stage);
+        });
+        if (child == node->Children.end()) {
+            node->Children.emplace_back(std::make_unique<TFanOutNode>());
+            node->Children.back()->Arguments.emplace_back(stage);
+            child = node->Children.end() - 1;
+        }
+        node = child->get();
+    }
+    node->Outputs.emplace_back(output_path);
+}
+
+/* Merges every run of nodes without a fork or an output into one, so it becomes a single chain and its colour
+   filters are still folded together */
+static void CompressTree(TFanOutNode& node) {
+    while (node.Outputs.empty() && node.Children.size() == 1) {
+        std::unique_ptr<TFanOutNode> child = std::move(node.Children[0]);
+        node.Arguments.insert(node.Arguments.end(), child->Arguments.begin(), child->Arguments.end());
+        node.Outputs = std::move(child->Outputs);
+        node.Children = std::move(child->Children);
+    }
+    for (auto& child : node.Children) {
+        CompressTree(*child);
+    }
+}
+
+static void RunFanOut(const TFanOutNode& node, Image& image) {
+    FilterChain chain = BuildPipeline(node.Arguments);
+    RunChain(chain, image);
+    for (const std::string& output_path : node.Outputs) {
+        WriteImage(image, output_path);
+    }
+    if (node.Children.empty()) {
+        return;
+    }
+    /* An only subtree takes the image itself. Siblings all run on views, including the last: one of them writing
+       the shared buffer in place could not know when the others are done reading it. */
+    if (node.Children.size() == 1) {
+        RunFanOut(*node.Children[0], image);
+        return;
+    }
+    std::vector<Image> views;
+    for (size_t i = 0; i < node.Children.size(); ++i) {
+        views.emplace_back(image.Share());
+    }
+    GetThreadPool().ParallelFor(node.Children.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            RunFanOut(*node.Children[i], views[i]);
+            views[i] = Image();
+        }
+    });
+}
+
+void ProcessFanOut(const std::string& input_path, const std::vector<TOutputBranch>& branches) {
+    Image image;
+    TFanOutNode root;
+    {
+        StageTimer read_timer;
+        BmpReader reader(input_path);
+        /* Every branch planned on its own, then shifted into the rectangle covering all of them */
+        std::vector<TRect> sources(branches.size());
+        std::vector<std::vector<TParams>> plans(branches.size());
+        TRect bounds = {reader.GetWidth(), reader.GetHeight(), 0, 0};
+        int32_t right = 0;
+        int32_t bottom = 0;
+        for (size_t i = 0; i < branches.size(); ++i) {
+            plans[i] = PushDownCrops(branches[i].Arguments, reader.GetWidth(), reader.GetHeight(), sources[i]);
+            bounds.X = std::min(bounds.X, sources[i].X);
+            bounds.Y = std::min(bounds.Y, sources[i].Y);
+            right = std::max(right, sources[i].X + sources[i].Width);
+            bottom = std::max(bottom, sources[i].Y + sources[i].Height);
+        }
+        bounds.Width = std::max(0, right - bounds.X);
+        bounds.Height = std::max(0, bottom - bounds.Y);
+        for (size_t i = 0; i < branches.size(); ++i) {
+            const TRect& source = sources[i];
+            if (source.X != bounds.X || source.Y != bounds.Y || source.Width != bounds.Width ||
+                source.Height != bounds.Height) {
+                plans[i].insert(plans[i].begin(), TParams{
+                                                      .Filter = EFilterType::Crop,
+                                                      .Param1 = source.Width,
+                                                      .Param2 = source.Height,
+                                                      .Param4 = source.X - bounds.X,
+                                                      .Param5 = source.Y - bounds.Y,
+                                                  });
+            }
+            InsertBranch(root, plans[i], branches[i].OutputPath);
+        }
+        CompressTree(root);
+        /* Outputs may overwrite the input, so it is decoded and closed before anything is written */
+        image.Read(reader, bounds.X, bounds.Y, bounds.Width, bounds.Height);
+        read_timer.Stop("read", 2 * GetPixelBytes(image), GetPixelCount(image));
+    }
+    RunFanOut(root, image);
+}
+
+void ProcessReader(BmpReader& reader, const std::vector<TParams>& arguments, Image& image) {
+    StageTimer read_timer;
+    ProcessDecoded(reader, arguments, image, read_timer);
+}
+
+void ApplyFilters(Image& image, const std::vector<TParams>& arguments) {
+    FilterChain chain = BuildPipeline(arguments);
+    RunChain(chain, image);
+}
+
+void ProcessBuffer(const uint8_t* data, size_t size, const std::vector<TParams>& arguments,
+                   std::vector<uint8_t>& output) {
+    Image image;
+    ProcessBuffer(data, size, arguments, output, image);
+}
+
+void ProcessBuffer(const uint8_t* data, size_t size, const std::vector<TParams>& arguments,
+                   std::vector<uint8_t>& output, Image& image) {
+    {
+        StageTimer read_timer;
+        BmpReader reader(data, size);
+        ProcessDecoded(reader, arguments, image, read_timer);
+    }
+    StageTimer write_timer;
+    image.Encode(output);
+    write_timer.Stop("write", 2 * GetPixelBytes(image), GetPixelCount(image));
+}
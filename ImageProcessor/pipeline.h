@@ -0,0 +1,75 @@
+#pragma once
+#include "filters.h"
+#include <memory>
+
+const size_t STREAM_BAND_BYTES = 1 << 20;
+
+using FilterChain = std::vector<std::unique_ptr<AbstractFilter>>;
+
+/* Rectangle of an image counted from its top-left corner */
+struct TRect {
+    int32_t X;
+    int32_t Y;
+    int32_t Width;
+    int32_t Height;
+};
+
+/* One output of a fan-out run and the whole chain producing it */
+struct TOutputBranch {
+    std::string OutputPath;
+    std::vector<TParams> Arguments;
+};
+
+/* Per-pixel filters and crops, which never look at neighbouring pixels */
+bool IsPointFilter(EFilterType filter);
+bool CanStream(const std::vector<TParams>& arguments);
+
+/* How far from an output pixel the filter reads its input, 0 for point filters */
+int32_t GetFilterHalo(const TParams& params);
+
+/* Parses the command line filter flag at args[i] with its parameters, the same flags the CLI takes, and moves i to
+   the last argument consumed. Returns false, leaving i alone, if args[i] is not a filter flag. */
+bool ParseFilterFlag(const std::vector<std::string>& args, size_t& i, std::vector<TParams>& arguments);
+/* Parses a whole chain given as CLI flags, e.g. {"-crop", "800", "600", "-gs"}; throws on anything else */
+std::vector<TParams> ParseFilterChain(const std::vector<std::string>& args);
+
+FilterChain BuildPipeline(const std::vector<TParams>& arguments);
+
+/* Rewrites the chain for a width x height source so that every stage only processes the part of its input that
+   reaches the output: `source` receives the rectangle of the source to decode, and the returned chain, applied to
+   that rectangle, gives exactly the output of `arguments` applied to the whole source. Neighbourhood filters keep
+   a halo around the region they are cropped to, which is trimmed off right after them. */
+std::vector<TParams> PushDownCrops(const std::vector<TParams>& arguments, int32_t width, int32_t height, TRect& source);
+
+/* The stages of ProcessFile for callers overlapping them across files, timed as stages of the same names when
+   profiling. DecodeForChain decodes the part of the input that reaches the output of `arguments` and returns the
+   chain that turns it into the output, RunChain applies a chain with every filter timed as its own stage. */
+FilterChain DecodeForChain(const std::string& input_path, const std::vector<TParams>& arguments, Image& image);
+void RunChain(FilterChain& chain, Image& image);
+void WriteImage(const Image& image, const std::string& output_path);
+
+/* Applies the chain reading and writing bands of rows, so only a few rows are held in memory at a time.
+   Requires CanStream(arguments). `band` is working storage, its buffers are reused when large enough. */
+void ProcessStreaming(const std::string& input_path, const std::string& output_path,
+                      const std::vector<TParams>& arguments, Image& band);
+void ProcessFile(const std::string& input_path, const std::string& output_path, const std::vector<TParams>& arguments);
+/* Same as above with `image` as the working storage, so a caller processing many files can keep its buffers */
+void ProcessFile(const std::string& input_path, const std::string& output_path, const std::vector<TParams>& arguments,
+                 Image& image);
+
+/* Decodes the input once and writes every branch. Branches starting with the same filters share them: the tree of
+   common prefixes is walked once, sibling subtrees run concurrently on copy-on-write views of their parent's image.
+   Crops are pushed down per branch, and the decoder reads the bounding rectangle of what the branches need. */
+void ProcessFanOut(const std::string& input_path, const std::vector<TOutputBranch>& branches);
+
+/* Decodes from `reader` the part of its image that reaches the output of the chain and applies the chain to it,
+   leaving the result in `image` */
+void ProcessReader(BmpReader& reader, const std::vector<TParams>& arguments, Image& image);
+/* Applies the chain to an image already in memory */
+void ApplyFilters(Image& image, const std::vector<TParams>& arguments);
+/* In-memory counterpart of ProcessFile: decodes the BMP file in `data`, applies the chain and encodes the result
+   into `output`. Only the part of the input that reaches the output is decoded, as for files. */
+void ProcessBuffer(const uint8_t* data, size_t size, const std::vector<TParams>& arguments,
+                   std::vector<uint8_t>& output);
+void ProcessBuffer(const uint8_t* data, size_t size, const std::vector<TParams>& arguments,
+                   std::vector<uint8_t>& output, Image& image);
@@ -0,0 +1,172 @@
+#include "profiler.h"
+#include "image_processor.h"
+#include <algorithm>
+#include <sys/resource.h>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+static double GetCpuSeconds() {
+    timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_nsec) * 1e-9;
+}
+
+size_t GetPeakRssBytes() {
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return static_cast<size_t>(usage.ru_maxrss) * 1024; /* Linux reports kilobytes */
+}
+
+static double GetMegapixelsPerSecond(const TStageProfile& stage) {
+    return stage.WallSeconds > 0 ? static_cast<double>(stage.Pixels) / stage.WallSeconds / 1e6 : 0;
+}
+
+static TStageProfile GetTotal(const std::vector<TStageProfile>& stages) {
+    TStageProfile total{.Name = "total"};
+    for (const TStageProfile& stage : stages) {
+        total.WallSeconds += stage.WallSeconds;
+        total.CpuSeconds += stage.CpuSeconds;
+        total.Bytes += stage.Bytes;
+        total.Allocations += stage.Allocations;
+        total.AllocatedBytes += stage.AllocatedBytes;
+        total.PeakLiveBytes = std::max(total.PeakLiveBytes, stage.PeakLiveBytes);
+    }
+    total.PeakRssBytes = GetPeakRssBytes();
+    /* Every stage sees the same image, so the first one stands for the pixels of the whole run */
+    total.Pixels = stages.empty() ? 0 : stages.front().Pixels;
+    return total;
+}
+
+void Profiler::Enable() {
+    enabled_ = true;
+}
+
+bool Profiler::IsEnabled() const {
+    return enabled_;
+}
+
+void Profiler::Record(const TStageProfile& run) {
+    std::lock_guard lock(mutex_);
+    auto stage = std::find_if(stages_.begin(), stages_.end(),
+                              [&](const TStageProfile& profile) { return profile.Name == run.Name; });
+    if (stage == stages_.end()) {
+        stage = stages_.insert(stages_.end(), TStageProfile{.Name = run.Name});
+    }
+    stage->WallSeconds += run.WallSeconds;
+    stage->CpuSeconds += run.CpuSeconds;
+    stage->Bytes += run.Bytes;
+    stage->Pixels += run.Pixels;
+    stage->Allocations += run.Allocations;
+    stage->AllocatedBytes += run.AllocatedBytes;
+    stage->PeakLiveBytes = std::max(stage->PeakLiveBytes, run.PeakLiveBytes);
+    stage->PeakRssBytes = std::max(stage->PeakRssBytes, run.PeakRssBytes);
+}
+
+std::vector<TStageProfile> Profiler::GetStages() const {
+    std::lock_guard lock(mutex_);
+    return stages_;
+}
+
+void Profiler::PrintTable(std::ostream& out) const {
+    std::vector<TStageProfile> stages = GetStages();
+    stages.emplace_back(GetTotal(stages));
+    out << std::left << std::setw(24) << "stage" << std::right << std::setw(12) << "wall ms" << std::setw(12)
+        << "cpu ms" << std::setw(12) << "MB" << std::setw(12) << "MP/s" << "\n";
+    out << std::fixed;
+    for (const TStageProfile& stage : stages) {
+        out << std::left << std::setw(24) << stage.Name << std::right << std::setprecision(2) << std::setw(12)
+            << stage.WallSeconds * 1e3 << std::setw(12) << stage.CpuSeconds * 1e3 << std::setprecision(1)
+            << std::setw(12) << static_cast<double>(stage.Bytes) / 1e6 << std::setw(12)
+            << GetMegapixelsPerSecond(stage) << "\n";
+    }
+    out << std::defaultfloat;
+}
+
+void Profiler::PrintMemoryTable(std::ostream& out) const {
+    std::vector<TStageProfile> stages = GetStages();
+    stages.emplace_back(GetTotal(stages));
+    out << std::left << std::setw(24) << "stage" << std::right << std::setw(12) << "allocs" << std::setw(12)
+        << "alloc MB" << std::setw(12) << "peak MB" << std::setw(12) << "rss MB" << "\n";
+    out << std::fixed << std::setprecision(1);
+    for (const TStageProfile& stage : stages) {
+        out << std::left << std::setw(24) << stage.Name << std::right << std::setw(12) << stage.Allocations
+            << std::setw(12) << static_cast<double>(stage.AllocatedBytes) / 1e6 << std::setw(12)
+            << static_cast<double>(stage.PeakLiveBytes) / 1e6 << std::setw(12)
+            << static_cast<double>(stage.PeakRssBytes) / 1e6 << "\n";
+    }
+    out << std::defaultfloat;
+}
+
+void Profiler::WriteJson(const std::string& output_path) const {
+    std::ofstream out(output_path);
+    if (!out) {
+        throw(std::runtime_error("Failed to create " + output_path + "\n"));
+    }
+    std::vector<TStageProfile> stages = GetStages();
+    const TStageProfile total = GetTotal(stages);
+    auto write_stage = [&](const TStageProfile& stage) {
+        /* Stage names are filter names and numbers, nothing that would need escaping */
+        out << "{\"name\": \"" << stage.Name << "\", \"wall_seconds\": " << stage.WallSeconds
+            << ", \"cpu_seconds\": " << stage.CpuSeconds << ", \"bytes\": " << stage.Bytes
+            << ", \"pixels\": " << stage.Pixels << ", \"megapixels_per_second\": " << GetMegapixelsPerSecond(stage)
+            << ", \"allocations\": " << stage.Allocations << ", \"allocated_bytes\": " << stage.AllocatedBytes
+            << ", \"peak_live_bytes\": " << stage.PeakLiveBytes << ", \"peak_rss_bytes\": " << stage.PeakRssBytes
+            << "}";
+    };
+    out << std::setprecision(9) << "{\n  \"stages\": [\n";
+    for (size_t i = 0; i < stages.size(); ++i) {
+        out << "    ";
+        write_stage(stages[i]);
+        out << (i + 1 < stages.size() ? ",\n" : "\n");
+    }
+    out << "  ],\n  \"total\": ";
+    write_stage(total);
+    out << "\n}\n";
+    if (!out.flush()) {
+        throw(std::runtime_error("Failed to write " + output_path + "\n"));
+    }
+}
+
+Profiler& GetProfiler() {
+    static Profiler profiler;
+    return profiler;
+}
+
+StageTimer::StageTimer() : enabled_(GetProfiler().IsEnabled()) {
+    if (enabled_) {
+        const TBufferStats buffers = GetBufferStats();
+        allocations_start_ = buffers.Allocations;
+        allocated_bytes_start_ = buffers.AllocatedBytes;
+        ResetBufferPeak();
+        wall_start_ = std::chrono::steady_clock::now();
+        cpu_start_ = GetCpuSeconds();
+    }
+}
+
+bool StageTimer::IsEnabled() const {
+    return enabled_;
+}
+
+void StageTimer::Stop(const std::string& name, size_t bytes, size_t pixels) {
+    if (!enabled_) {
+        return;
+    }
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start_).count();
+    const double cpu = GetCpuSeconds() - cpu_start_;
+    const TBufferStats buffers = GetBufferStats();
+    GetProfiler().Record(TStageProfile{
+        .Name = name,
+        .WallSeconds = wall,
+        .CpuSeconds = cpu,
+        .Bytes = bytes,
+        .Pixels = pixels,
+        .Allocations = buffers.Allocations - allocations_start_,
+        .AllocatedBytes = buffers.AllocatedBytes - allocated_bytes_start_,
+        .PeakLiveBytes = buffers.PeakLiveBytes,
+        .PeakRssBytes = GetPeakRssBytes(),
+    });
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct TStageProfile {
+    std::string Name;
+    double WallSeconds = 0;
+    double CpuSeconds = 0; /* CPU time of the whole process, so pool workers are included */
+    size_t Bytes = 0;      /* Pixel and file bytes the stage read plus the bytes it wrote */
+    size_t Pixels = 0;
+    size_t Allocations = 0;    /* Buffers allocated through AlignedAllocator, see TBufferStats */
+    size_t AllocatedBytes = 0;
+    size_t PeakLiveBytes = 0;  /* Largest amount of buffer memory alive at once during the stage */
+    size_t PeakRssBytes = 0;   /* Process peak resident set size when the stage ended */
+};
+
+/* Totals per stage name over everything processed since the profiler was enabled. Stages of concurrent files in a
+   batch overlap, so there wall time is summed over files and CPU time is only indicative. */
+class Profiler {
+public:
+    void Enable();
+    bool IsEnabled() const;
+    /* Adds one run of a stage, `run.Name` selects the row */
+    void Record(const TStageProfile& run);
+    std::vector<TStageProfile> GetStages() const;
+    void PrintTable(std::ostream& out) const;
+    void PrintMemoryTable(std::ostream& out) const;
+    void WriteJson(const std::string& output_path) const;
+
+private:
+    bool enabled_ = false;
+    mutable std::mutex mutex_;
+    std::vector<TStageProfile> stages_; /* In order of first appearance */
+};
+
+Profiler& GetProfiler();
+
+/* Measures one stage from construction to Stop, does nothing unless the profiler is enabled */
+class StageTimer {
+public:
+    StageTimer();
+    bool IsEnabled() const;
+    void Stop(const std::string& name, size_t bytes, size_t pixels);
+
+private:
+    bool enabled_;
+    std::chrono::steady_clock::time_point wall_start_;
+    double cpu_start_ = 0;
+    size_t allocations_start_ = 0;
+    size_t allocated_bytes_start_ = 0;
+};
+
+size_t GetPeakRssBytes();
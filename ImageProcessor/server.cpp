@@ -0,0 +1,434 @@
+#include "server.h"
+#include "bmp_io.h"
+#include "bounded_queue.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <list>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+/* Builds a message payload, see TServeRequest for the layout */
+class MessageWriter {
+public:
+    void PutByte(uint8_t value) {
+        payload_.push_back(value);
+    }
+    void PutLength(size_t length) {
+        if (length > SERVER_MAX_MESSAGE_BYTES) {
+            throw(std::runtime_error("Message is too large\n"));
+        }
+        const uint32_t value = static_cast<uint32_t>(length);
+        const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+        payload_.insert(payload_.end(), bytes, bytes + sizeof(value));
+    }
+    void PutBytes(const uint8_t* data, size_t size) {
+        PutLength(size);
+        payload_.insert(payload_.end(), data, data + size);
+    }
+    void PutString(const std::string& value) {
+        PutBytes(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+    }
+    const std::vector<uint8_t>& GetPayload() const {
+        return payload_;
+    }
+
+private:
+    std::vector<uint8_t> payload_;
+};
+
+/* Walks a received payload, byte arrays are returned as views into it */
+class MessageReader {
+public:
+    explicit MessageReader(const std::vector<uint8_t>& payload) : payload_(payload) {
+    }
+    uint8_t GetByte() {
+        return *Take(1);
+    }
+    size_t GetLength() {
+        uint32_t value = 0;
+        std::memcpy(&value, Take(sizeof(value)), sizeof(value));
+        return value;
+    }
+    const uint8_t* GetBytes(size_t& size) {
+        size = GetLength();
+        return Take(size);
+    }
+    std::string GetString() {
+        size_t size = 0;
+        const uint8_t* data = GetBytes(size);
+        return std::string(reinterpret_cast<const char*>(data), size);
+    }
+    size_t GetRemaining() const {
+        return payload_.size() - position_;
+    }
+
+private:
+    const uint8_t* Take(size_t size) {
+        if (size > payload_.size() - position_) {
+            throw(std::runtime_error("Malformed message\n"));
+        }
+        const uint8_t* data = payload_.data() + position_;
+        position_ += size;
+        return data;
+    }
+
+    const std::vector<uint8_t>& payload_;
+    size_t position_ = 0;
+};
+
+/* A parsed request waiting for a worker. The inline input points into the received payload. */
+struct TServeJob {
+    int Fd = -1;
+    std::vector<uint8_t> Payload;
+    std::vector<TParams> Arguments;
+    std::string InputPath;
+    const uint8_t* InputData = nullptr;
+    size_t InputSize = 0;
+    std::string OutputPath;
+    std::promise<void> Done;
+};
+
+struct TConnection {
+    int Fd;
+    std::thread Thread;
+    std::atomic<bool> Finished = false;
+};
+}  // namespace
+
+static int wake_write_fd = -1;
+
+static void HandleStopSignal(int) {
+    const char stop = 's';
+    [[maybe_unused]] ssize_t done = write(wake_write_fd, &stop, 1);
+}
+
+/* Returns false if the peer closed the connection before the first byte */
+static bool ReceiveAll(int fd, uint8_t* data, size_t size, bool allow_eof) {
+    while (size > 0) {
+        ssize_t done = recv(fd, data, size, 0);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done == 0 && allow_eof) {
+            return false;
+        }
+        if (done <= 0) {
+            throw(std::runtime_error("Connection lost\n"));
+        }
+        data += done;
+        size -= static_cast<size_t>(done);
+        allow_eof = false;
+    }
+    return true;
+}
+
+static void SendAll(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        /* A client that went away must not kill the server with SIGPIPE */
+        ssize_t done = send(fd, data, size, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            throw(std::runtime_error("Connection lost\n"));
+        }
+        data += done;
+        size -= static_cast<size_t>(done);
+    }
+}
+
+/* Returns false if the peer closed the connection between messages */
+static bool ReceiveMessage(int fd, std::vector<uint8_t>& payload) {
+    uint32_t length = 0;
+    if (!ReceiveAll(fd, reinterpret_cast<uint8_t*>(&length), sizeof(length), true)) {
+        return false;
+    }
+    if (length > SERVER_MAX_MESSAGE_BYTES) {
+        throw(std::runtime_error("Message is too large\n"));
+    }
+    payload.resize(length);
+    ReceiveAll(fd, payload.data(), length, false);
+    return true;
+}
+
+/* Sends `head` followed by `size` bytes of `body` as one message, so a large body is never copied into a payload */
+static void SendMessage(int fd, const std::vector<uint8_t>& head, const uint8_t* body, size_t size) {
+    const uint32_t length = static_cast<uint32_t>(head.size() + size);
+    SendAll(fd, reinterpret_cast<const uint8_t*>(&length), sizeof(length));
+    SendAll(fd, head.data(), head.size());
+    SendAll(fd, body, size);
+}
+
+static void SendResponse(int fd, bool succeeded, const uint8_t* data, size_t size) {
+    MessageWriter head;
+    head.PutByte(succeeded ? 0 : 1);
+    head.PutLength(size);
+    SendMessage(fd, head.GetPayload(), data, size);
+}
+
+static void SendError(int fd, const std::string& error) {
+    SendResponse(fd, false, reinterpret_cast<const uint8_t*>(error.data()), error.size());
+}
+
+static void ParseRequest(TServeJob& job) {
+    MessageReader reader(job.Payload);
+    /* The count comes from the client: every flag takes at least its length, so a count the payload cannot hold
+       is rejected before anything is allocated for it */
+    const size_t count = reader.GetLength();
+    if (count > reader.GetRemaining() / sizeof(uint32_t)) {
+        throw(std::runtime_error("Malformed message\n"));
+    }
+    std::vector<std::string> filters;
+    for (size_t i = 0; i < count; ++i) {
+        filters.emplace_back(reader.GetString());
+    }
+    const uint8_t input_kind = reader.GetByte();
+    if (input_kind == 0) {
+        job.InputPath = reader.GetString();
+    } else {
+        job.InputData = reader.GetBytes(job.InputSize);
+    }
+    job.OutputPath = reader.GetString();
+    job.Arguments = ParseFilterChain(filters);
+}
+
+/* Leaves the encoded result in `output` unless the request names an output path */
+static void ProcessJob(const TServeJob& job, Image& image, std::vector<uint8_t>& output) {
+    output.clear();
+    if (job.InputData == nullptr && !job.OutputPath.empty()) {
+        ProcessFile(job.InputPath, job.OutputPath, job.Arguments, image);
+        return;
+    }
+    {
+        std::unique_ptr<BmpReader> reader = job.InputData != nullptr
+                                                ? std::make_unique<BmpReader>(job.InputData, job.InputSize)
+                                                : std::make_unique<BmpReader>(job.InputPath);
+        ProcessReader(*reader, job.Arguments, image);
+    }
+    if (job.OutputPath.empty()) {
+        image.Encode(output);
+    } else {
+        image.Write(job.OutputPath);
+    }
+}
+
+/* Every worker keeps its image and output buffer between requests, so pixel buffers are not allocated anew */
+static void ServeWorker(BoundedQueue<TServeJob>& queue) {
+    Image image;
+    std::vector<uint8_t> output;
+    TServeJob job;
+    while (queue.Pop(job)) {
+        try {
+            try {
+                ProcessJob(job, image, output);
+                SendResponse(job.Fd, true, output.data(), output.size());
+            } catch (std::exception& e) {
+                SendError(job.Fd, e.what());
+            }
+            job.Done.set_value();
+        } catch (...) {
+            job.Done.set_exception(std::current_exception());
+        }
+    }
+}
+
+/* Requests of one connection are answered in order, the next one is read only after the response went out */
+static void ServeConnection(int fd, BoundedQueue<TServeJob>& queue) {
+    try {
+        std::vector<uint8_t> payload;
+        while (ReceiveMessage(fd, payload)) {
+            TServeJob job;
+            job.Fd = fd;
+            job.Payload = std::move(payload);
+            try {
+                ParseRequest(job);
+            } catch (std::exception& e) {
+                SendError(fd, e.what());
+                continue;
+            }
+            std::future<void> done = job.Done.get_future();
+            if (!queue.Push(std::move(job))) {
+                return;
+            }
+            done.get();
+        }
+    } catch (std::exception&) {
+        /* The client went away, nothing is left to answer */
+    }
+}
+
+static int CreateListener(const std::string& socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw(std::runtime_error("Socket path " + socket_path + " is too long\n"));
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    /* A socket left behind by a server that did not shut down cleanly is replaced, any other file is not */
+    struct stat file_stat;
+    if (stat(socket_path.c_str(), &file_stat) == 0 && S_ISSOCK(file_stat.st_mode)) {
+        unlink(socket_path.c_str());
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw(std::runtime_error("Failed to create a socket\n"));
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        throw(std::runtime_error("Failed to listen on " + socket_path + "\n"));
+    }
+    return fd;
+}
+
+void Serve(const std::string& socket_path, const TServerOptions& options) {
+    const size_t workers = options.Workers > 0 ? options.Workers : GetThreadPool().GetConcurrency();
+    const size_t queue_depth = options.QueueDepth > 0 ? options.QueueDepth : 2 * workers;
+
+    const int listen_fd = CreateListener(socket_path);
+    int wake_fds[2];
+    if (pipe2(wake_fds, O_CLOEXEC) != 0) {
+        close(listen_fd);
+        throw(std::runtime_error("Failed to create a pipe\n"));
+    }
+    /* Signals and finished connections wake the accept loop through the pipe */
+    wake_write_fd = wake_fds[1];
+    struct sigaction stop_action {};
+    stop_action.sa_handler = HandleStopSignal;
+    stop_action.sa_flags = SA_RESTART;
+    struct sigaction old_interrupt;
+    struct sigaction old_terminate;
+    sigaction(SIGINT, &stop_action, &old_interrupt);
+    sigaction(SIGTERM, &stop_action, &old_terminate);
+
+    BoundedQueue<TServeJob> queue(queue_depth);
+    std::vector<std::thread> worker_threads;
+    for (size_t i = 0; i < workers; ++i) {
+        worker_threads.emplace_back([&queue] { ServeWorker(queue); });
+    }
+
+    std::list<TConnection> connections;
+    auto reap_connections = [&connections] {
+        for (auto connection = connections.begin(); connection != connections.end();) {
+            if (!connection->Finished) {
+                ++connection;
+                continue;
+            }
+            connection->Thread.join();
+            close(connection->Fd);
+            connection = connections.erase(connection);
+        }
+    };
+
+    bool stopping = false;
+    while (!stopping) {
+        reap_connections();
+        /* Past the connection limit new clients stay in the listen backlog */
+        const short accepting = connections.size() < SERVER_MAX_CONNECTIONS ? POLLIN : 0;
+        pollfd fds[2] = {{wake_fds[0], POLLIN, 0}, {listen_fd, accepting, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char wake[64];
+            const ssize_t count = read(wake_fds[0], wake, sizeof(wake));
+            stopping = count > 0 && std::memchr(wake, 's', static_cast<size_t>(count)) != nullptr;
+        }
+        if (!stopping && (fds[1].revents & POLLIN)) {
+            const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            TConnection& connection = connections.emplace_back();
+            connection.Fd = fd;
+            connection.Thread = std::thread([&connection, &queue, wake_fd = wake_fds[1]] {
+                ServeConnection(connection.Fd, queue);
+                connection.Finished = true;
+                const char finished = 'c';
+                [[maybe_unused]] ssize_t done = write(wake_fd, &finished, 1);
+            });
+        }
+    }
+
+    /* Requests already read are still answered, connections just stop reading new ones */
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    for (TConnection& connection : connections) {
+        shutdown(connection.Fd, SHUT_RD);
+    }
+    for (TConnection& connection : connections) {
+        connection.Thread.join();
+        close(connection.Fd);
+    }
+    queue.Close();
+    for (std::thread& worker : worker_threads) {
+        worker.join();
+    }
+    sigaction(SIGINT, &old_interrupt, nullptr);
+    sigaction(SIGTERM, &old_terminate, nullptr);
+    wake_write_fd = -1;
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+}
+
+TServeResponse SendRequest(const std::string& socket_path, const TServeRequest& request) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw(std::runtime_error("Socket path " + socket_path + " is too long\n"));
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw(std::runtime_error("Failed to connect to " + socket_path + "\n"));
+    }
+
+    TServeResponse response;
+    try {
+        MessageWriter message;
+        message.PutLength(request.Filters.size());
+        for (const std::string& filter : request.Filters) {
+            message.PutString(filter);
+        }
+        if (request.InputData.empty()) {
+            message.PutByte(0);
+            message.PutString(request.InputPath);
+        } else {
+            message.PutByte(1);
+            message.PutBytes(request.InputData.data(), request.InputData.size());
+        }
+        message.PutString(request.OutputPath);
+        SendMessage(fd, message.GetPayload(), nullptr, 0);
+
+        std::vector<uint8_t> payload;
+        if (!ReceiveMessage(fd, payload)) {
+            throw(std::runtime_error("Connection closed by " + socket_path + "\n"));
+        }
+        MessageReader reader(payload);
+        response.Succeeded = reader.GetByte() == 0;
+        size_t size = 0;
+        const uint8_t* data = reader.GetBytes(size);
+        if (response.Succeeded) {
+            response.OutputData.assign(data, data + size);
+        } else {
+            response.Error.assign(reinterpret_cast<const char*>(data), size);
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return response;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "pipeline.h"
+
+const size_t SERVER_MAX_MESSAGE_BYTES = size_t{1} << 30;
+const size_t SERVER_MAX_CONNECTIONS = 64;
+
+/* A request to the server. Messages on the socket are a native-endian uint32 payload length followed by the
+   payload; strings and byte arrays inside it are a uint32 length followed by the bytes. A request payload is the
+   filter flags (a count and the strings), an input kind byte (0 a path, 1 an inline BMP file) with the path or the
+   file, and the output path. A response payload is a status byte (0 success, 1 failure) and the encoded BMP file,
+   empty when the output went to a path, or the error message. */
+struct TServeRequest {
+    std::vector<std::string> Filters; /* CLI filter flags, see ParseFilterChain */
+    std::string InputPath;            /* Read by the server when InputData is empty */
+    std::vector<uint8_t> InputData;   /* A whole BMP file */
+    std::string OutputPath;           /* Written by the server, or the result comes back inline when empty */
+};
+
+struct TServeResponse {
+    bool Succeeded = false;
+    std::string Error;
+    std::vector<uint8_t> OutputData;
+};
+
+struct TServerOptions {
+    size_t Workers = 0;    /* Requests processed at once, the thread pool concurrency when 0 */
+    size_t QueueDepth = 0; /* Requests waiting for a worker, twice the workers when 0 */
+};
+
+/* Serves requests on a Unix domain socket at `socket_path` until SIGINT or SIGTERM. Every connection sends
+   requests one at a time and gets a response to each. Workers keep their images between requests, and the filters
+   inside a request share the process thread pool. When the queue is full, connections stop reading until a worker
+   frees a slot, and past SERVER_MAX_CONNECTIONS new clients wait in the listen backlog. */
+void Serve(const std::string& socket_path, const TServerOptions& options);
+
+/* Client side: sends one request over a new connection and waits for the response. Throws if the server cannot be
+   reached, a failed request comes back as a response with Succeeded unset. */
+TServeResponse SendRequest(const std::string& socket_path, const TServeRequest& request);
@@ -6,9 +6,13 @@ from PIL import Image, ImageChops, UnidentifiedImageError
 import math
 import operator
 import os
+import signal
+import socket
+import struct
 import subprocess
 import sys
 import tempfile
+import time
 
 
 def calc_images_distance(image_path1, image_path2):
@@ -19,8 +23,40 @@ def calc_images_distance(image_path1, image_path2):
                 float(image1.size[0]) * image1.size[1]))
 
 
+def encode_server_string(value):
+    return struct.pack("=I", len(value)) + value
+
+
+def encode_server_request(filters, input_file, output_file):
+    """A path request as laid out in server.h, every length a native-endian uint32"""
+    return (struct.pack("=I", len(filters)) + b"".join(encode_server_string(f.encode()) for f in filters) + b"\x00" +
+            encode_server_string(input_file.encode()) + encode_server_string(output_file.encode()))
+
+
+def exchange_server_message(connection, payload):
+    """Sends one framed message and returns (status, body) of the response, or None if the server hung up"""
+    connection.sendall(struct.pack("=I", len(payload)) + payload)
+    response = b""
+    while len(response) < 4 or len(response) < 4 + struct.unpack("=I", response[:4])[0]:
+        chunk = connection.recv(65536)
+        if not chunk:
+            return None
+        response += chunk
+    return response[4], response[9:]
+
+
 class ImageProcessorTester:
     TestCase = namedtuple("TestCase", ["name", "input", "args", "eps"])
+    # One run writing every branch with -o; each output must equal a single run of args + branch. The run is repeated
+    # `repeat` times on the input enlarged `scale` times, so branches running in parallel overlap.
+    FanOutTestCase = namedtuple("FanOutTestCase", ["name", "input", "args", "branches", "repeat", "scale"],
+                                defaults=[1, 1])
+    # One --batch run over a manifest of inputs, names missing from the data directory stand for unreadable files;
+    # every readable input must equal its single run and the run must exit with exit_code
+    BatchTestCase = namedtuple("BatchTestCase", ["name", "inputs", "args", "exit_code"])
+    # A --serve process answering --connect in path and --inline mode byte for byte like a single run, and
+    # malformed frames on a raw connection with an error reply; it must exit cleanly on SIGINT
+    ServerTestCase = namedtuple("ServerTestCase", ["name", "input", "args"])
 
     class TestCaseFailedException(Exception):
         pass
@@ -46,6 +82,8 @@ class ImageProcessorTester:
                                               args=["-crop", "999", "1999", "-crop", "100", "1"],
                                               eps=0.0),
                 ImageProcessorTester.TestCase(input="flag", name="crop", args=["-crop", "50", "50"], eps=0.0),
+                ImageProcessorTester.TestCase(input="flag", name="crop_origin", args=["-crop", "2", "5", "6", "8"],
+                                              eps=0.0),
             ],
             "edge": [
                 ImageProcessorTester.TestCase(input="flag", name="edge", args=["-edge", "0.1"], eps=1.0),
@@ -71,6 +109,31 @@ class ImageProcessorTester:
                 ImageProcessorTester.TestCase(input="lenna", name="blur", args=["-blur", "7.5"], eps=2.0),
                 ImageProcessorTester.TestCase(input="lenna", name="blur_blur", args=["-blur", "7.5", "-blur", "3"],
                                               eps=2.0),
+                ImageProcessorTester.TestCase(input="flag", name="blur", args=["-blur", "1.5"], eps=2.0),
+                ImageProcessorTester.TestCase(input="flag", name="blur_wide", args=["-blur", "50"], eps=2.0),
+                ImageProcessorTester.TestCase(input="flag", name="blur_huge", args=["-blur", "100000"], eps=2.0),
+            ],
+        }
+        mode_test_cases = {
+            "fan_out": [
+                ImageProcessorTester.FanOutTestCase(input="flag", name="fan_out", args=["-crop", "2", "5", "6", "8"],
+                                                    branches=[[], ["-gs"], ["-gs", "-edge", "0.1"], ["-sharp"],
+                                                              ["-blur", "1.5", "-neg"]]),
+                ImageProcessorTester.FanOutTestCase(input="flag", name="fan_out_stress",
+                                                    args=["-crop", "10", "10", "300", "200", "--threads", "4"],
+                                                    branches=[["-gs"], ["-edge", "0.1"], ["-sharp"], ["-neg"],
+                                                              ["-gs", "-blur", "2"], ["-gs", "-neg"], []],
+                                                    repeat=20, scale=40),
+            ],
+            "batch": [
+                ImageProcessorTester.BatchTestCase(name="batch", inputs=["flag", "flag_crop_origin", "flag_blur"],
+                                                   args=["-gs", "-sharp"], exit_code=0),
+                ImageProcessorTester.BatchTestCase(name="batch_missing", inputs=["flag", "missing", "flag_blur"],
+                                                   args=["-crop", "1", "1", "5", "5", "-edge", "0.1"], exit_code=2),
+            ],
+            "serve": [
+                ImageProcessorTester.ServerTestCase(input="flag", name="serve",
+                                                    args=["-crop", "1", "2", "8", "15", "-gs", "-blur", "1.5"]),
             ],
         }
         ok_filters = set()
@@ -83,6 +146,19 @@ class ImageProcessorTester:
             except ImageProcessorTester.TestCaseFailedException:
                 pass
 
+        for mode_name, test_cases in mode_test_cases.items():
+            try:
+                for test_case in test_cases:
+                    if isinstance(test_case, ImageProcessorTester.BatchTestCase):
+                        self.run_batch_test_case(test_case)
+                    elif isinstance(test_case, ImageProcessorTester.ServerTestCase):
+                        self.run_server_test_case(test_case)
+                    else:
+                        self.run_fan_out_test_case(test_case)
+                ok_filters.add(mode_name)
+            except ImageProcessorTester.TestCaseFailedException:
+                pass
+
         if ok_filters:
             print("-----\nTOTAL {ok_filters_count} OK FILTERS: {ok_filters}\n-----".format(
                 ok_filters_count=len(ok_filters),
@@ -119,6 +195,159 @@ class ImageProcessorTester:
         except UnidentifiedImageError:
             self.fail_test_case(test_case.input, test_case.name, "output file is corrupt")
 
+    def run_fan_out_test_case(self, test_case):
+        try:
+            input_file = os.path.join("test_script", "data", "{input}.bmp".format(input=test_case.input))
+
+            with tempfile.TemporaryDirectory() as output_dir:
+                if test_case.scale != 1:
+                    with Image.open(input_file) as image:
+                        input_file = os.path.join(output_dir, "input.bmp")
+                        image.resize((image.size[0] * test_case.scale, image.size[1] * test_case.scale),
+                                     Image.NEAREST).save(input_file)
+
+                branch_args = []
+                for index, branch in enumerate(test_case.branches):
+                    single_output_file = os.path.join(output_dir, "single{index}.bmp".format(index=index))
+                    subprocess.check_call(
+                        [self.image_processor_executable, input_file, single_output_file] + test_case.args + branch,
+                        timeout=180)
+                    branch_args += ["-o", os.path.join(output_dir, "branch{index}.bmp".format(index=index))] + branch
+
+                for run in range(test_case.repeat):
+                    subprocess.check_call([self.image_processor_executable, input_file] + test_case.args + branch_args,
+                                          timeout=180)
+
+                    for index in range(len(test_case.branches)):
+                        images_distance = calc_images_distance(
+                            os.path.join(output_dir, "single{index}.bmp".format(index=index)),
+                            os.path.join(output_dir, "branch{index}.bmp".format(index=index)))
+                        if images_distance > 0.0:
+                            self.fail_test_case(
+                                test_case.input, test_case.name,
+                                "run {run}: branch {index} differs from its single run with rms diff {diff}".format(
+                                    run=run, index=index, diff=images_distance))
+
+            self.succeed_test_case(test_case.input, test_case.name)
+        except subprocess.CalledProcessError:
+            self.fail_test_case(test_case.input, test_case.name, "image_processor finished with non-zero exit code")
+        except subprocess.TimeoutExpired:
+            self.fail_test_case(test_case.input, test_case.name, "timeout")
+        except FileNotFoundError:
+            self.fail_test_case(test_case.input, test_case.name, "output file not found")
+        except UnidentifiedImageError:
+            self.fail_test_case(test_case.input, test_case.name, "output file is corrupt")
+
+    def run_batch_test_case(self, test_case):
+        try:
+            with tempfile.TemporaryDirectory() as output_dir:
+                manifest_file = os.path.join(output_dir, "manifest.txt")
+                with open(manifest_file, "w") as manifest:
+                    for index, input in enumerate(test_case.inputs):
+                        input_file = os.path.join("test_script", "data", "{input}.bmp".format(input=input))
+                        output_file = os.path.join(output_dir, "batch{index}.bmp".format(index=index))
+                        manifest.write("{input}\t{output}\n".format(input=input_file, output=output_file))
+
+                exit_code = subprocess.call(
+                    [self.image_processor_executable, "--batch", manifest_file] + test_case.args, timeout=180)
+                if exit_code != test_case.exit_code:
+                    self.fail_test_case("batch", test_case.name,
+                                        "image_processor finished with exit code {code}".format(code=exit_code))
+
+                for index, input in enumerate(test_case.inputs):
+                    input_file = os.path.join("test_script", "data", "{input}.bmp".format(input=input))
+                    if not os.path.exists(input_file):
+                        continue
+                    single_output_file = os.path.join(output_dir, "single{index}.bmp".format(index=index))
+                    subprocess.check_call([self.image_processor_executable, input_file, single_output_file] +
+                                          test_case.args, timeout=180)
+
+                    images_distance = calc_images_distance(
+                        single_output_file, os.path.join(output_dir, "batch{index}.bmp".format(index=index)))
+                    if images_distance > 0.0:
+                        self.fail_test_case("batch", test_case.name,
+                                            "{input} differs from its single run with rms diff {diff}".format(
+                                                input=input, diff=images_distance))
+
+            self.succeed_test_case("batch", test_case.name)
+        except subprocess.CalledProcessError:
+            self.fail_test_case("batch", test_case.name, "image_processor finished with non-zero exit code")
+        except subprocess.TimeoutExpired:
+            self.fail_test_case("batch", test_case.name, "timeout")
+        except FileNotFoundError:
+            self.fail_test_case("batch", test_case.name, "output file not found")
+        except UnidentifiedImageError:
+            self.fail_test_case("batch", test_case.name, "output file is corrupt")
+
+    def run_server_test_case(self, test_case):
+        server = None
+        try:
+            input_file = os.path.abspath(
+                os.path.join("test_script", "data", "{input}.bmp".format(input=test_case.input)))
+
+            with tempfile.TemporaryDirectory() as output_dir:
+                socket_file = os.path.join(output_dir, "server.sock")
+                server = subprocess.Popen([self.image_processor_executable, "--serve", socket_file, "--workers", "2"])
+                deadline = time.monotonic() + 10
+                while not os.path.exists(socket_file):
+                    if server.poll() is not None or time.monotonic() > deadline:
+                        self.fail_test_case(test_case.input, test_case.name, "server did not start")
+                    time.sleep(0.05)
+
+                single_output_file = os.path.join(output_dir, "single.bmp")
+                subprocess.check_call(
+                    [self.image_processor_executable, input_file, single_output_file] + test_case.args, timeout=180)
+                with open(single_output_file, "rb") as single_output:
+                    expected = single_output.read()
+
+                for mode, mode_args in [("path", []), ("inline", ["--inline"])]:
+                    output_file = os.path.join(output_dir, "{mode}.bmp".format(mode=mode))
+                    subprocess.check_call([self.image_processor_executable, "--connect", socket_file, input_file,
+                                           output_file] + mode_args + test_case.args, timeout=180)
+                    with open(output_file, "rb") as output:
+                        if output.read() != expected:
+                            self.fail_test_case(test_case.input, test_case.name,
+                                                "{mode} output differs from the single run".format(mode=mode))
+
+                request = encode_server_request(test_case.args, input_file, os.path.join(output_dir, "raw.bmp"))
+                malformed_requests = [
+                    ("truncated frame", request[:len(request) // 2]),
+                    ("oversized filter count", struct.pack("=I", 0xFFFFFFFF) + request[4:]),
+                ]
+                with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as connection:
+                    connection.settimeout(60)
+                    connection.connect(socket_file)
+                    for description, payload in malformed_requests:
+                        response = exchange_server_message(connection, payload)
+                        if response is None or response[0] != 1 or not response[1]:
+                            self.fail_test_case(test_case.input, test_case.name,
+                                                "no error reply to the {description}".format(description=description))
+                    # The connection survives the errors
+                    response = exchange_server_message(connection, request)
+                    if response is None or response[0] != 0:
+                        self.fail_test_case(test_case.input, test_case.name, "request after the errors failed")
+                with open(os.path.join(output_dir, "raw.bmp"), "rb") as output:
+                    if output.read() != expected:
+                        self.fail_test_case(test_case.input, test_case.name, "raw output differs from the single run")
+
+                server.send_signal(signal.SIGINT)
+                if server.wait(timeout=60) != 0:
+                    self.fail_test_case(test_case.input, test_case.name, "server finished with non-zero exit code")
+
+            self.succeed_test_case(test_case.input, test_case.name)
+        except subprocess.CalledProcessError:
+            self.fail_test_case(test_case.input, test_case.name, "image_processor finished with non-zero exit code")
+        except (subprocess.TimeoutExpired, socket.timeout):
+            self.fail_test_case(test_case.input, test_case.name, "timeout")
+        except FileNotFoundError:
+            self.fail_test_case(test_case.input, test_case.name, "output file not found")
+        except ConnectionError:
+            self.fail_test_case(test_case.input, test_case.name, "server dropped the connection")
+        finally:
+            if server is not None and server.poll() is None:
+                server.kill()
+                server.wait()
+
 
 if __name__ == "__main__":
     tester = ImageProcessorTester(image_processor_executable=sys.argv[1])
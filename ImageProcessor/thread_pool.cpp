@@ -0,0 +1,134 @@
+#include "thread_pool.h"
+#include <atomic>
+#include <exception>
+#include <memory>
+
+const size_t CHUNKS_PER_THREAD = 4;
+
+ThreadPool::ThreadPool(size_t workers) {
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back([this] { WorkerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    has_tasks_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    if (workers_.empty()) {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.emplace_back(std::move(task));
+    }
+    has_tasks_.notify_one();
+}
+
+size_t ThreadPool::GetConcurrency() const {
+    return workers_.size() + 1;
+}
+
+void ThreadPool::WorkerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            has_tasks_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+namespace {
+struct TParallelForState {
+    std::function<void(size_t, size_t)> Body;
+    size_t Count;
+    size_t Chunk;
+    size_t Chunks;
+    std::atomic<size_t> NextChunk = 0;
+    std::atomic<size_t> DoneChunks = 0;
+    std::mutex Mutex;
+    std::condition_variable Done;
+    std::exception_ptr Error;
+
+    void Run() {
+        for (size_t index = NextChunk++; index < Chunks; index = NextChunk++) {
+            try {
+                Body(index * Chunk, std::min(Count, (index + 1) * Chunk));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(Mutex);
+                if (!Error) {
+                    Error = std::current_exception();
+                }
+            }
+            if (++DoneChunks == Chunks) {
+                std::lock_guard<std::mutex> lock(Mutex);
+                Done.notify_all();
+            }
+        }
+    }
+};
+}  // namespace
+
+void ThreadPool::ParallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)>& body) {
+    if (count == 0) {
+        return;
+    }
+    chunk = std::max<size_t>(chunk, 1);
+    const size_t chunks = (count + chunk - 1) / chunk;
+    if (chunks == 1 || workers_.empty()) {
+        body(0, count);
+        return;
+    }
+
+    /* Helpers may start after everything is done, so they share ownership of the state with the caller */
+    auto state = std::make_shared<TParallelForState>();
+    state->Body = body;
+    state->Count = count;
+    state->Chunk = chunk;
+    state->Chunks = chunks;
+    for (size_t helper = 0; helper < std::min(workers_.size(), chunks - 1); ++helper) {
+        Submit([state] { state->Run(); });
+    }
+    state->Run();
+    {
+        std::unique_lock<std::mutex> lock(state->Mutex);
+        state->Done.wait(lock, [&] { return state->DoneChunks == state->Chunks; });
+    }
+    if (state->Error) {
+        std::rethrow_exception(state->Error);
+    }
+}
+
+static size_t thread_count = 0;
+
+void SetThreadCount(size_t threads) {
+    thread_count = threads;
+}
+
+ThreadPool& GetThreadPool() {
+    static ThreadPool pool(std::max<size_t>(thread_count == 0 ? std::thread::hardware_concurrency() : thread_count,
+                                            1) -
+                           1);
+    return pool;
+}
+
+size_t GetChunkSize(size_t count) {
+    const size_t chunks = GetThreadPool().GetConcurrency() * CHUNKS_PER_THREAD;
+    return std::max<size_t>(1, (count + chunks - 1) / chunks);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    /* `workers` background threads, callers of ParallelFor work alongside them */
+    explicit ThreadPool(size_t workers);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    void Submit(std::function<void()> task);
+    /* Number of threads that can run a ParallelFor at once, including the caller */
+    size_t GetConcurrency() const;
+    /* Calls body(begin, end) for consecutive chunks of [0, count) of at most `chunk` items and returns when all of
+       them are done. The calling thread takes chunks too, so this never waits on a queue that is busy with the
+       caller itself and may be nested inside pool tasks. The first exception thrown by `body` is rethrown. */
+    void ParallelFor(size_t count, size_t chunk, const std::function<void(size_t, size_t)>& body);
+
+private:
+    void WorkerLoop();
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable has_tasks_;
+    bool stopping_ = false;
+};
+
+/* Process-wide pool, created on first use with SetThreadCount threads (the core count by default) */
+ThreadPool& GetThreadPool();
+void SetThreadCount(size_t threads);
+/* Chunk size giving every thread of the pool a few chunks of `count` items */
+size_t GetChunkSize(size_t count);
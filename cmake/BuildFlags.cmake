@@ -16,4 +16,8 @@ set(CMAKE_CXX_FLAGS_ASAN "-g -fsanitize=address,undefined -fno-sanitize-recover=
     CACHE STRING "Compiler flags in asan build"
     FORCE)
 
+set(CMAKE_CXX_FLAGS_TSAN "-g -O1 -fsanitize=thread"
+    CACHE STRING "Compiler flags in tsan build"
+    FORCE)
+
 set(CMAKE_CXX_FLAGS_COVERAGE "${CMAKE_CXX_FLAGS_ASAN} -fprofile-instr-generate -fcoverage-mapping")